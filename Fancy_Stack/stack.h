@@ -4,8 +4,58 @@
 #include <iterator>
 #include <cstddef>  // ptrdiff_t
 #include <memory>
+#include <new>
 #include <list>
 #include <map>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <compare>
+#include <concepts>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <thread>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+#include <array>
+#include <numeric>
+#include <ranges>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__AVX2__)
+#define CXX_STACK_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || \
+	(defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CXX_STACK_SSE2
+#endif
+#if defined(__SSE4_1__) || defined(__AVX__)
+#define CXX_STACK_SSE41
+#endif
+#if defined(CXX_STACK_AVX2) || defined(CXX_STACK_SSE2)
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define CXX_STACK_HAS_TSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CXX_STACK_HAS_TSC
+#endif
+#if defined(CXX_STACK_USDT) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CXX_STACK_HAS_USDT
+#endif
 
 namespace cxx
 {
@@ -18,63 +68,2657 @@ namespace cxx
 	using std::ptrdiff_t;
 	using std::forward_iterator_tag;
 
-	// Every stack will have a shared_ptr 
-	// pointing to the stack data object,
-	// and if they share it and one modified it, then we 
-	// create a new stack_data for it.
-	template <typename K, typename V> class stack_data
+	// Smallest number of elements worth handing to a separate thread
+	// in the parallel traversals.
+	inline constexpr size_t parallel_grain = 1 << 14;
+
+	// Execution policies accepted by the stack traversals. They mirror
+	// std::execution::seq and par without pulling in <execution>, which
+	// requires linking a parallel backend with some standard libraries.
+	namespace execution
+	{
+		struct sequenced_policy {};
+		struct parallel_policy {};
+
+		inline constexpr sequenced_policy seq{};
+		inline constexpr parallel_policy par{};
+	}
+
+	template <typename T>
+	concept execution_policy =
+		std::same_as<T, execution::sequenced_policy> ||
+		std::same_as<T, execution::parallel_policy>;
+
+	// Number of distinct keys kept in the flat key index before
+	// the stack falls back to the key tree.
+	inline constexpr size_t flat_key_capacity = 32;
+
+	// Describes how a key is represented inside the flat key index.
+	// Only keys that map one-to-one onto a machine word can use it.
+	template <typename K>
+	struct flat_key_traits
+	{
+		static constexpr bool enabled = false;
+	};
+
+	template <std::integral K>
+	struct flat_key_traits<K>
+	{
+		static constexpr bool enabled = true;
+		using word = std::conditional_t<sizeof(K) <= 4, uint32_t, uint64_t>;
+
+		static word to_word(K key) noexcept
+		{
+			return static_cast<word>(key);
+		}
+	};
+
+	// Contiguous array of distinct keys, used while the stack holds only
+	// a few of them. A lookup compares the whole array with vector
+	// instructions (or a plain loop), which is cheaper than a tree descent.
+	// When the array overflows the index is promoted, i.e. switched off,
+	// until the number of keys drops back to half of its capacity.
+	template <typename Word, typename Iter, size_t Capacity>
+	class flat_key_index
+	{
+		static_assert(Capacity % 8 == 0, "Capacity must fill whole vectors.");
+
+		alignas(32) Word keys[Capacity]{};
+		Iter iters[Capacity]{};
+		size_t used = 0;
+		bool bIsPromoted = false;
+
+		// Returns the position of the key, or used if it isn't indexed.
+		size_t position(Word key) const noexcept;
+	public:
+		// Returns whether lookups should go through the index.
+		bool active() const noexcept
+		{
+			return !bIsPromoted;
+		}
+
+		// Returns the iterator stored with the key, or not_found.
+		Iter find(Word key, Iter not_found) const noexcept
+		{
+			size_t pos = position(key);
+			return pos < used ? iters[pos] : not_found;
+		}
+
+		// Adds a key that isn't indexed yet. Promotes the index if full.
+		void insert(Word key, Iter iter) noexcept
+		{
+			if (bIsPromoted)
+			{
+				return;
+			}
+			if (used == Capacity)
+			{
+				bIsPromoted = true;
+				used = 0;
+				return;
+			}
+			keys[used] = key;
+			iters[used] = iter;
+			++used;
+		}
+
+		// Removes the key by moving the last entry into its place.
+		void erase(Word key) noexcept
+		{
+			size_t pos = position(key);
+			if (pos < used)
+			{
+				--used;
+				keys[pos] = keys[used];
+				iters[pos] = iters[used];
+			}
+		}
+
+		// Drops every key and turns the index back on.
+		void reset() noexcept
+		{
+			used = 0;
+			bIsPromoted = false;
+		}
+
+		// Rebuilds the index from the key tree, promoting it
+		// if the tree holds too many keys.
+		template <typename Map, typename ToWord>
+		void rebuild(Map& map, ToWord to_word) noexcept
+		{
+			reset();
+			if (map.size() > Capacity)
+			{
+				bIsPromoted = true;
+				return;
+			}
+			for (auto iter = map.begin(); iter != map.end(); ++iter)
+			{
+				insert(to_word(iter->first), iter);
+			}
+		}
+	};
+
+	template <typename Word, typename Iter, size_t Capacity>
+	size_t flat_key_index<Word, Iter, Capacity>::position(Word key)
+		const noexcept
+	{
+		// Slots past used may hold stale keys, but they always come after
+		// the valid ones, so the lowest match is the right one.
+#if defined(CXX_STACK_AVX2)
+		if constexpr (sizeof(Word) == 4)
+		{
+			__m256i needle = _mm256_set1_epi32(static_cast<int>(key));
+			for (size_t i = 0; i < used; i += 8)
+			{
+				__m256i block = _mm256_load_si256(
+					reinterpret_cast<__m256i const*>(keys + i));
+				unsigned mask = static_cast<unsigned>(_mm256_movemask_ps(
+					_mm256_castsi256_ps(_mm256_cmpeq_epi32(block, needle))));
+				if (mask != 0)
+				{
+					size_t pos = i + std::countr_zero(mask);
+					return pos < used ? pos : used;
+				}
+			}
+			return used;
+		}
+		else
+		{
+			__m256i needle = _mm256_set1_epi64x(static_cast<long long>(key));
+			for (size_t i = 0; i < used; i += 4)
+			{
+				__m256i block = _mm256_load_si256(
+					reinterpret_cast<__m256i const*>(keys + i));
+				unsigned mask = static_cast<unsigned>(_mm256_movemask_pd(
+					_mm256_castsi256_pd(_mm256_cmpeq_epi64(block, needle))));
+				if (mask != 0)
+				{
+					size_t pos = i + std::countr_zero(mask);
+					return pos < used ? pos : used;
+				}
+			}
+			return used;
+		}
+#elif defined(CXX_STACK_SSE2)
+		if constexpr (sizeof(Word) == 4)
+		{
+			__m128i needle = _mm_set1_epi32(static_cast<int>(key));
+			for (size_t i = 0; i < used; i += 4)
+			{
+				__m128i block = _mm_load_si128(
+					reinterpret_cast<__m128i const*>(keys + i));
+				unsigned mask = static_cast<unsigned>(_mm_movemask_ps(
+					_mm_castsi128_ps(_mm_cmpeq_epi32(block, needle))));
+				if (mask != 0)
+				{
+					size_t pos = i + std::countr_zero(mask);
+					return pos < used ? pos : used;
+				}
+			}
+			return used;
+		}
+#if defined(CXX_STACK_SSE41)
+		else
+		{
+			__m128i needle = _mm_set1_epi64x(static_cast<long long>(key));
+			for (size_t i = 0; i < used; i += 2)
+			{
+				__m128i block = _mm_load_si128(
+					reinterpret_cast<__m128i const*>(keys + i));
+				unsigned mask = static_cast<unsigned>(_mm_movemask_pd(
+					_mm_castsi128_pd(_mm_cmpeq_epi64(block, needle))));
+				if (mask != 0)
+				{
+					size_t pos = i + std::countr_zero(mask);
+					return pos < used ? pos : used;
+				}
+			}
+			return used;
+		}
+#endif
+#endif
+		// Scalar fallback.
+		for (size_t i = 0; i < used; ++i)
+		{
+			if (keys[i] == key)
+			{
+				return i;
+			}
+		}
+		return used;
+	}
+
+	template <typename K>
+	class interned_key;
+
+	// Dictionary giving every distinct key a stable integer ID. Keys are
+	// stored once and referenced by interned_key handles, which count
+	// their uses. IDs are unique across all dictionaries of a key type,
+	// so handles from different dictionaries never compare equal. The
+	// dictionary must outlive its handles; global() is never destroyed.
+	template <typename K>
+	class key_dictionary
+	{
+	public:
+		struct entry
+		{
+			K const* key = nullptr;
+			uint64_t id;
+			std::atomic<size_t> refs{ 0 };
+
+			explicit entry(uint64_t id) : id(id)
+			{}
+		};
+
+		// Shared dictionary used by handles made straight from a key.
+		static key_dictionary& global()
+		{
+			static key_dictionary* dictionary = new key_dictionary();
+			return *dictionary;
+		}
+
+		// Returns the handle of the key, adding the key if needed.
+		interned_key<K> intern(K const& key);
+
+		// Returns the handle of the key if it is already in the dictionary.
+		std::optional<interned_key<K>> find(K const& key) const;
+
+		// Drops the keys without handles. Returns how many were dropped.
+		// Entries are never dropped otherwise, not even when their last
+		// handle goes away, so a dictionary whose keys come and go, the
+		// global() one included, grows until purge() is called.
+		size_t purge();
+
+		// Returns the number of keys in the dictionary.
+		size_t size() const
+		{
+			std::shared_lock lock(mutex);
+			return entries.size();
+		}
+
+	private:
+		mutable std::shared_mutex mutex;
+		std::unordered_map<K, entry> entries;
+
+		// Returns an ID not given to any key of any dictionary before.
+		// The counter is 64-bit, so it never wraps in practice.
+		static uint64_t next_id() noexcept
+		{
+			static std::atomic<uint64_t> counter{ 0 };
+			return counter.fetch_add(1, std::memory_order_relaxed);
+		}
+	};
+
+	// Handle of a key stored in a key_dictionary. Using it as the key type
+	// of a stack, e.g. stack<interned_key<std::string>, V>, stores every
+	// key once for all stacks and makes key comparisons integer ones.
+	// Keys are ordered by their IDs, i.e. in the order they were interned,
+	// and equal if they have the same ID.
+	template <typename K>
+	class interned_key
+	{
+		using entry = typename key_dictionary<K>::entry;
+
+		entry* ptr;
+
+		friend class key_dictionary<K>;
+
+		// Constructor taking a reference to the entry.
+		explicit interned_key(entry* ptr) noexcept : ptr(ptr)
+		{
+			ptr->refs.fetch_add(1, std::memory_order_relaxed);
+		}
+	public:
+		// Constructor interning the key in the global dictionary. Explicit,
+		// so that looking a key up in a stack never interns it.
+		explicit interned_key(K const& key)
+			: interned_key(key_dictionary<K>::global().intern(key))
+		{}
+
+		interned_key(interned_key const& other) noexcept
+			: interned_key(other.ptr)
+		{}
+
+		interned_key& operator=(interned_key const& other) noexcept
+		{
+			other.ptr->refs.fetch_add(1, std::memory_order_relaxed);
+			release();
+			ptr = other.ptr;
+			return *this;
+		}
+
+		~interned_key()
+		{
+			release();
+		}
+
+		K const& get() const noexcept
+		{
+			return *ptr->key;
+		}
+
+		operator K const&() const noexcept
+		{
+			return *ptr->key;
+		}
+
+		uint64_t id() const noexcept
+		{
+			return ptr->id;
+		}
+
+		friend bool operator==(interned_key const& a,
+			interned_key const& b) noexcept
+		{
+			return a.id() == b.id();
+		}
+
+		friend std::strong_ordering operator<=>(interned_key const& a,
+			interned_key const& b) noexcept
+		{
+			return a.id() <=> b.id();
+		}
+
+	private:
+		void release() noexcept
+		{
+			ptr->refs.fetch_sub(1, std::memory_order_release);
+		}
+	};
+
+	template <typename K>
+	inline interned_key<K> key_dictionary<K>::intern(K const& key)
+	{
+		std::scoped_lock lock(mutex);
+		auto iter = entries.find(key);
+		if (iter == entries.end())
+		{
+			iter = entries.try_emplace(key, next_id()).first;
+			iter->second.key = &iter->first;
+		}
+		return interned_key<K>(&iter->second);
+	}
+
+	template <typename K>
+	inline std::optional<interned_key<K>> key_dictionary<K>::find(
+		K const& key) const
+	{
+		std::shared_lock lock(mutex);
+		auto iter = entries.find(key);
+		if (iter == entries.end())
+		{
+			return std::nullopt;
+		}
+		return interned_key<K>(const_cast<entry*>(&iter->second));
+	}
+
+	template <typename K>
+	inline size_t key_dictionary<K>::purge()
+	{
+		std::scoped_lock lock(mutex);
+		return std::erase_if(entries, [](auto const& item)
+			{ return item.second.refs.load(std::memory_order_acquire) == 0; });
+	}
+
+	// Interned keys go through the flat key index by their IDs.
+	template <typename K>
+	struct flat_key_traits<interned_key<K>>
+	{
+		static constexpr bool enabled = true;
+		using word = uint64_t;
+
+		static word to_word(interned_key<K> const& key) noexcept
+		{
+			return key.id();
+		}
+	};
+
+	// Lets stack<K, V> look keys up by another type, without making a K.
+	// Disabled by default. Interned keys are looked up by the plain key
+	// with key_dictionary::find(), so absent keys are never interned.
+	template <typename K>
+	struct key_lookup_traits
+	{
+		static constexpr bool enabled = false;
+		struct query {};
+	};
+
+	template <typename K>
+	struct key_lookup_traits<interned_key<K>>
+	{
+		static constexpr bool enabled = true;
+		using query = K;
+
+		static std::optional<interned_key<K>> find(K const& key)
+		{
+			return key_dictionary<K>::global().find(key);
+		}
+	};
+
+	// Placeholder used instead of the flat key index for other keys.
+	struct no_flat_key_index {};
+
+	// Keys that std::hash can hash.
+	template <typename K>
+	concept hashable_key = requires(K const& key)
+	{
+		{ std::hash<K>{}(key) } -> std::convertible_to<size_t>;
+	};
+
+	// Counting Bloom filter over the keys of a stack, used to answer
+	// lookups of absent keys without descending the key tree. All probes
+	// of a key fall into one 64-byte block, so a lookup reads a single
+	// cache line. A counter that saturates stays saturated for good.
+	template <typename K>
+	class key_filter
+	{
+		static constexpr size_t probes = 4;
+		static constexpr size_t counters_per_key = 8;
+
+		struct alignas(64) block
+		{
+			uint8_t counters[64];
+		};
+
+		std::vector<block> blocks;
+
+		// Mixes std::hash, which is the identity for integers.
+		static uint64_t hash(K const& key) noexcept
+		{
+			uint64_t h = static_cast<uint64_t>(std::hash<K>{}(key));
+			h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+			return h ^ (h >> 31);
+		}
+
+		block& block_of(uint64_t h) noexcept
+		{
+			return blocks[h & (blocks.size() - 1)];
+		}
+
+		block const& block_of(uint64_t h) const noexcept
+		{
+			return blocks[h & (blocks.size() - 1)];
+		}
+
+		// Returns the counter probed by the i-th probe.
+		static size_t slot(uint64_t h, size_t i) noexcept
+		{
+			return (h >> (32 + 6 * i)) & 63;
+		}
+	public:
+		explicit key_filter(size_t expected_keys)
+			: blocks(std::bit_ceil(std::max<size_t>(1,
+				expected_keys * counters_per_key / 64)), block{})
+		{}
+
+		void insert(K const& key) noexcept
+		{
+			uint64_t h = hash(key);
+			block& b = block_of(h);
+			for (size_t i = 0; i < probes; ++i)
+			{
+				uint8_t& counter = b.counters[slot(h, i)];
+				if (counter != UINT8_MAX)
+				{
+					++counter;
+				}
+			}
+		}
+
+		void erase(K const& key) noexcept
+		{
+			uint64_t h = hash(key);
+			block& b = block_of(h);
+			for (size_t i = 0; i < probes; ++i)
+			{
+				uint8_t& counter = b.counters[slot(h, i)];
+				if (counter != UINT8_MAX)
+				{
+					--counter;
+				}
+			}
+		}
+
+		// Returns false only if the key is certainly absent.
+		bool may_contain(K const& key) const noexcept
+		{
+			uint64_t h = hash(key);
+			block const& b = block_of(h);
+			for (size_t i = 0; i < probes; ++i)
+			{
+				if (b.counters[slot(h, i)] == 0)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		void clear() noexcept
+		{
+			std::fill(blocks.begin(), blocks.end(), block{});
+		}
+	};
+
+	// Selects the key index used by stack_data.
+	template <typename K, typename Iter, bool = flat_key_traits<K>::enabled>
+	struct select_key_index
+	{
+		using type = no_flat_key_index;
+	};
+
+	template <typename K, typename Iter>
+	struct select_key_index<K, Iter, true>
+	{
+		using type = flat_key_index<typename flat_key_traits<K>::word,
+			Iter, flat_key_capacity>;
+	};
+
+	// Allocation counters of the stacks used by one thread. Every heap
+	// allocation made for a stack goes through heap_allocate(). Counted
+	// only if CXX_STACK_ALLOCATION_STATS is defined, the same way in all
+	// translation units; otherwise the counters stay at 0.
+	struct allocation_stats
+	{
+#if defined(CXX_STACK_ALLOCATION_STATS)
+		static constexpr bool enabled = true;
+#else
+		static constexpr bool enabled = false;
+#endif
+
+		uint64_t node_requests = 0; // Nodes asked for by the containers.
+		uint64_t heap_allocations = 0; // Calls to operator new.
+		uint64_t heap_bytes = 0; // Bytes asked from operator new.
+		uint64_t heap_frees = 0; // Calls to operator delete.
+
+		static allocation_stats& local() noexcept
+		{
+			thread_local allocation_stats stats;
+			return stats;
+		}
+
+		static void count_node_request() noexcept
+		{
+			if constexpr (enabled)
+			{
+				++local().node_requests;
+			}
+		}
+
+		static void* heap_allocate(size_t size, size_t align)
+		{
+			if constexpr (enabled)
+			{
+				allocation_stats& stats = local();
+				++stats.heap_allocations;
+				stats.heap_bytes += size;
+			}
+			if (align > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+			{
+				return ::operator new(size, std::align_val_t{ align });
+			}
+			return ::operator new(size);
+		}
+
+		static void heap_free(void* ptr, size_t align) noexcept
+		{
+			if constexpr (enabled)
+			{
+				++local().heap_frees;
+			}
+			if (align > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+			{
+				::operator delete(ptr, std::align_val_t{ align });
+				return;
+			}
+			::operator delete(ptr);
+		}
+
+		allocation_stats operator-(allocation_stats const& other)
+			const noexcept
+		{
+			return { node_requests - other.node_requests,
+				heap_allocations - other.heap_allocations,
+				heap_bytes - other.heap_bytes,
+				heap_frees - other.heap_frees };
+		}
+	};
+
+	// Measures the allocations made for stacks by this thread since the
+	// probe was created. Used to keep operations within their budgets.
+	// Measures nothing unless allocation_stats::enabled.
+	class allocation_probe
+	{
+		allocation_stats start = allocation_stats::local();
+	public:
+		allocation_stats measured() const noexcept
+		{
+			return allocation_stats::local() - start;
+		}
+
+		// Returns whether at most the given number of heap allocations,
+		// and of bytes, were made.
+		bool within_budget(uint64_t allocations,
+			uint64_t bytes = UINT64_MAX) const noexcept
+		{
+			allocation_stats delta = measured();
+			return delta.heap_allocations <= allocations &&
+				delta.heap_bytes <= bytes;
+		}
+	};
+
+	// Per-thread cache of freed container nodes, grouped in size classes
+	// of 16 bytes. Nothing is cached unless an owner sets capacity aside
+	// with reserve() or retain(): freed nodes are kept for reuse up to the
+	// per-class limits these raise, the rest go back to operator delete.
+	// Every owner gives its capacity back with release(), from any thread.
+	class node_cache
+	{
+	public:
+		static constexpr size_t granularity = 16;
+		static constexpr size_t classes = 32;
+
+		// Numbers of nodes wanted, as (node size, count) pairs.
+		using requests = std::span<const pair<size_t, size_t>>;
+
+		// The cache of one thread, as seen from other threads. Capacity
+		// they give back waits here until that thread applies it.
+		struct owner
+		{
+			std::atomic<size_t> refs{ 1 };
+			std::atomic<bool> bIsPending{ false };
+			std::atomic<size_t> returned[classes]{};
+		};
+
+		// Returns whether nodes of this shape go through the cache.
+		static constexpr bool cacheable(size_t size, size_t align) noexcept
+		{
+			return size <= granularity * classes &&
+				align <= alignof(std::max_align_t);
+		}
+
+		static void* allocate(size_t size)
+		{
+			size_class& list = local().lists[index(size)];
+			if (list.head != nullptr)
+			{
+				free_node* node = list.head;
+				list.head = node->next;
+				--list.cached;
+				return node;
+			}
+			return allocation_stats::heap_allocate(class_size(size), 1);
+		}
+
+		static void deallocate(void* ptr, size_t size) noexcept
+		{
+			state& cache = local();
+			apply_returned(cache);
+			size_class& list = cache.lists[index(size)];
+			if (cache.bIsDead || list.cached >= list.limit)
+			{
+				allocation_stats::heap_free(ptr, 1);
+				return;
+			}
+			register_drainer();
+			list.head = ::new (ptr) free_node{ list.head };
+			++list.cached;
+		}
+
+		// Returns whether cache is the one of this thread.
+		static bool is_local(owner const* cache) noexcept
+		{
+			return cache != nullptr && cache == local().self;
+		}
+
+		// Returns the cache of this thread, held for the caller, or null
+		// if the thread is exiting or out of memory. Capacity set aside
+		// with reserve() or retain() is given back through it.
+		static owner* hold_local() noexcept
+		{
+			state& cache = local();
+			if (cache.bIsDead)
+			{
+				return nullptr;
+			}
+			if (cache.self == nullptr)
+			{
+				cache.self = new (std::nothrow) owner();
+				if (cache.self == nullptr)
+				{
+					return nullptr;
+				}
+				register_drainer();
+			}
+			cache.self->refs.fetch_add(1, std::memory_order_relaxed);
+			return cache.self;
+		}
+
+		// Raises the limits by the requested numbers of nodes and makes
+		// sure that at least that many nodes of every class are cached.
+		static void reserve(requests wanted)
+		{
+			size_t counts[classes]{};
+			if (!retain(wanted, counts))
+			{
+				return;
+			}
+			for (size_t i = 0; i < classes; ++i)
+			{
+				size_class& list = local().lists[i];
+				while (list.cached < counts[i])
+				{
+					size_t size = (i + 1) * granularity;
+					deallocate(allocation_stats::heap_allocate(size, 1), size);
+				}
+			}
+		}
+
+		// Raises the limits so that the requested numbers of nodes are
+		// kept when freed, without allocating anything.
+		static void retain(requests wanted) noexcept
+		{
+			size_t counts[classes]{};
+			retain(wanted, counts);
+		}
+
+		// Gives capacity set aside by reserve() or retain() back to the
+		// cache of from and lets go of it. On that thread the limits are
+		// lowered and the cached nodes above them freed at once, other
+		// threads leave the capacity for it to apply on its next call.
+		static void release(owner* from, requests wanted) noexcept
+		{
+			size_t counts[classes]{};
+			sum(wanted, counts);
+			if (from == local().self)
+			{
+				lower(counts);
+			}
+			else
+			{
+				for (size_t i = 0; i < classes; ++i)
+				{
+					if (counts[i] != 0)
+					{
+						from->returned[i].fetch_add(counts[i],
+							std::memory_order_relaxed);
+					}
+				}
+				from->bIsPending.store(true, std::memory_order_release);
+			}
+			drop(from);
+		}
+
+		// Frees every cached node and drops all limits.
+		static void trim() noexcept
+		{
+			for (size_class& list : local().lists)
+			{
+				while (list.head != nullptr)
+				{
+					free_node* node = list.head;
+					list.head = node->next;
+					allocation_stats::heap_free(node, 1);
+				}
+				list.cached = 0;
+				list.limit = 0;
+			}
+		}
+
+	private:
+		struct free_node
+		{
+			free_node* next;
+		};
+
+		struct size_class
+		{
+			free_node* head;
+			size_t cached;
+			size_t limit;
+		};
+
+		// Trivially destructible, so it stays usable while
+		// the thread_local objects of an exiting thread are destroyed.
+		struct state
+		{
+			size_class lists[classes];
+			owner* self;
+			bool bIsDead;
+		};
+
+		// Frees the cache when the thread exits.
+		struct drainer
+		{
+			~drainer()
+			{
+				state& cache = local();
+				trim();
+				cache.bIsDead = true;
+				drop(std::exchange(cache.self, nullptr));
+			}
+		};
+
+		static state& local() noexcept
+		{
+			thread_local state cache{};
+			return cache;
+		}
+
+		static void register_drainer() noexcept
+		{
+			thread_local drainer cache_drainer;
+			(void)cache_drainer;
+		}
+
+		static void drop(owner* from) noexcept
+		{
+			if (from != nullptr &&
+				from->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				delete from;
+			}
+		}
+
+		// Applies the capacity other threads gave back to this one.
+		static void apply_returned(state& cache) noexcept
+		{
+			if (cache.self == nullptr || !cache.self->bIsPending.load(
+				std::memory_order_relaxed))
+			{
+				return;
+			}
+			cache.self->bIsPending.exchange(false, std::memory_order_acquire);
+			size_t counts[classes];
+			for (size_t i = 0; i < classes; ++i)
+			{
+				counts[i] = cache.self->returned[i].exchange(0,
+					std::memory_order_relaxed);
+			}
+			lower(counts);
+		}
+
+		// Lowers the limits by counts and frees the nodes above them.
+		static void lower(size_t const (&counts)[classes]) noexcept
+		{
+			for (size_t i = 0; i < classes; ++i)
+			{
+				size_class& list = local().lists[i];
+				list.limit -= std::min(list.limit, counts[i]);
+				while (list.cached > list.limit)
+				{
+					free_node* node = list.head;
+					list.head = node->next;
+					--list.cached;
+					allocation_stats::heap_free(node, 1);
+				}
+			}
+		}
+
+		// Sums the requests per class into counts.
+		static void sum(requests wanted, size_t (&counts)[classes]) noexcept
+		{
+			for (auto [size, count] : wanted)
+			{
+				if (cacheable(size, 1))
+				{
+					counts[index(size)] += count;
+				}
+			}
+		}
+
+		// Sums the requests per class into counts and raises the limits.
+		// Returns false if the cache is gone.
+		static bool retain(requests wanted, size_t (&counts)[classes]) noexcept
+		{
+			state& cache = local();
+			if (cache.bIsDead)
+			{
+				return false;
+			}
+			apply_returned(cache);
+			sum(wanted, counts);
+			for (size_t i = 0; i < classes; ++i)
+			{
+				cache.lists[i].limit += counts[i];
+			}
+			return true;
+		}
+
+		static constexpr size_t index(size_t size) noexcept
+		{
+			return (std::max<size_t>(size, 1) - 1) / granularity;
+		}
+
+		static constexpr size_t class_size(size_t size) noexcept
+		{
+			return (index(size) + 1) * granularity;
+		}
+	};
+
+	// Stateless allocator used by all containers of a stack. Single
+	// nodes go through node_cache, everything else to operator new.
+	// All instances are equal, so nodes may be spliced between stacks.
+	template <typename T>
+	struct node_allocator
+	{
+		using value_type = T;
+		using is_always_equal = std::true_type;
+		using propagate_on_container_move_assignment = std::true_type;
+
+		node_allocator() noexcept = default;
+
+		template <typename U>
+		node_allocator(node_allocator<U> const&) noexcept
+		{}
+
+		T* allocate(size_t n)
+		{
+			allocation_stats::count_node_request();
+			if (n == 1 && node_cache::cacheable(sizeof(T), alignof(T)))
+			{
+				return static_cast<T*>(node_cache::allocate(sizeof(T)));
+			}
+			return static_cast<T*>(allocation_stats::heap_allocate(
+				n * sizeof(T), alignof(T)));
+		}
+
+		void deallocate(T* ptr, size_t n) noexcept
+		{
+			if (n == 1 && node_cache::cacheable(sizeof(T), alignof(T)))
+			{
+				node_cache::deallocate(ptr, sizeof(T));
+				return;
+			}
+			allocation_stats::heap_free(ptr, alignof(T));
+		}
+
+		template <typename U>
+		bool operator==(node_allocator<U> const&) const noexcept
+		{
+			return true;
+		}
+	};
+
+	template <typename T>
+	using node_list = list<T, node_allocator<T>>;
+
+	// Like make_shared, but allocates through node_allocator.
+	template <typename T, typename... Args>
+	shared_ptr<T> make_node_shared(Args&&... args)
+	{
+		return std::allocate_shared<T>(node_allocator<T>{},
+			std::forward<Args>(args)...);
+	}
+
+	template <typename K, typename M, typename Compare = std::less<K>>
+	using node_map = map<K, M, Compare, node_allocator<pair<const K, M>>>;
+
+	// Estimated size of a list or tree node holding a T, used to reserve
+	// nodes before the containers allocate any. It matches the layout of
+	// the common standard libraries: two links per list node, three links
+	// and a color per tree node.
+	template <typename T, size_t Links>
+	inline constexpr size_t node_size_with_links =
+		(Links * sizeof(void*) + sizeof(T) +
+			std::max(alignof(T), alignof(void*)) - 1) /
+		std::max(alignof(T), alignof(void*)) *
+		std::max(alignof(T), alignof(void*));
+
+	template <typename T>
+	inline constexpr size_t list_node_size = node_size_with_links<T, 2>;
+
+	template <typename T>
+	inline constexpr size_t tree_node_size = node_size_with_links<T, 4>;
+
+	// Decides whether a stack keeps its values out of line. Large values
+	// are boxed, so splitting the stack data shares the boxes instead of
+	// copying the values. Can be specialized for a given value type.
+	template <typename V>
+	struct value_storage_traits
+	{
+		static constexpr bool out_of_line =
+			sizeof(V) > 64 && std::is_copy_constructible_v<V>;
+	};
+
+	// Reference-counted box holding one immutable-while-shared value.
+	template <typename V>
+	class shared_value
+	{
+		struct box
+		{
+			std::atomic<size_t> refs;
+			V value;
+		};
+
+		box* ptr;
+
+		void release() noexcept
+		{
+			if (ptr->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				ptr->~box();
+				node_allocator<box>{}.deallocate(ptr, 1);
+			}
+		}
+	public:
+		explicit shared_value(V const& value)
+			: ptr(node_allocator<box>{}.allocate(1))
+		{
+			try
+			{
+				::new (ptr) box{ { 1 }, value };
+			}
+			catch (...)
+			{
+				node_allocator<box>{}.deallocate(ptr, 1);
+				throw;
+			}
+		}
+
+		shared_value(shared_value const& other) noexcept : ptr(other.ptr)
+		{
+			ptr->refs.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		shared_value& operator=(shared_value const& other) noexcept
+		{
+			other.ptr->refs.fetch_add(1, std::memory_order_relaxed);
+			release();
+			ptr = other.ptr;
+			return *this;
+		}
+
+		~shared_value()
+		{
+			release();
+		}
+
+		V const& get() const noexcept
+		{
+			return ptr->value;
+		}
+
+		// Returns the value for modification, first copying it
+		// if the box is shared.
+		V& get_mut()
+		{
+			if (ptr->refs.load(std::memory_order_acquire) != 1)
+			{
+				shared_value copy(ptr->value);
+				*this = copy;
+			}
+			return ptr->value;
+		}
+
+		// Returns a copy that doesn't share the box.
+		shared_value clone() const
+		{
+			return shared_value(ptr->value);
+		}
+	};
+
+	// How values are kept in the lists of a stack: as they are,
+	// or boxed, depending on value_storage_traits.
+	template <typename V, bool = value_storage_traits<V>::out_of_line>
+	struct value_storage
+	{
+		using type = V;
+
+		static V const& get(V const& value) noexcept
+		{
+			return value;
+		}
+
+		static V& get_mut(V& value) noexcept
+		{
+			return value;
+		}
+
+		static V const& make(V const& value) noexcept
+		{
+			return value;
+		}
+
+		static V const& clone(V const& value) noexcept
+		{
+			return value;
+		}
+	};
+
+	template <typename V>
+	struct value_storage<V, true>
+	{
+		using type = shared_value<V>;
+
+		static V const& get(type const& value) noexcept
+		{
+			return value.get();
+		}
+
+		static V& get_mut(type& value)
+		{
+			return value.get_mut();
+		}
+
+		static type make(V const& value)
+		{
+			return type(value);
+		}
+
+		static type clone(type const& value)
+		{
+			return value.clone();
+		}
+	};
+
+	template <typename K, typename V> class stack;
+
+	// Identifies an element pushed with push_with_handle(). The element
+	// keeps it in copies of the stack, too.
+	class element_handle
+	{
+		uint64_t serial = 0;
+
+		explicit element_handle(uint64_t serial) noexcept : serial(serial)
+		{}
+
+		template <typename K, typename V>
+		friend class stack;
+	public:
+		element_handle() noexcept = default; // Handle of no element.
+
+		bool operator==(element_handle const&) const noexcept = default;
+	};
+
+	// Monoid kept up to date for every key of stack<K, V>, so that
+	// aggregate() doesn't scan the values. Disabled by default. To enable
+	// it, specialize it with enabled = true, a type, and static
+	// identity(), lift(V const&) and associative combine(type, type).
+	template <typename K, typename V>
+	struct stack_aggregate_policy
+	{
+		static constexpr bool enabled = false;
+	};
+
+	// Running aggregate kept with every element, empty if disabled.
+	template <typename Policy, bool = Policy::enabled>
+	struct aggregate_slot
+	{};
+
+	template <typename Policy>
+	struct aggregate_slot<Policy, true>
+	{
+		// Of the values with the same key, up to this one.
+		typename Policy::type running = Policy::identity();
+		// Set if the value may have changed since running was computed.
+		bool bIsStale = false;
+	};
+
+	// Every stack will have a shared_ptr 
+	// pointing to the stack data object,
+	// and if they share it and one modified it, then we 
+	// create a new stack_data for it.
+	template <typename K, typename V> class stack_data
+	{
+	public:
+		using storage = value_storage<V>;
+		using value_list = node_list<typename storage::type>;
+		using element_map = node_map<K, value_list>;
+		using element_iterator = typename value_list::iterator;
+		using element_by_key_iterator = typename element_map::iterator;
+		using aggregate_policy = stack_aggregate_policy<K, V>;
+
+		// Entry of an element in the stack order. Named like a pair,
+		// which it used to be.
+		struct element_entry
+		{
+			element_by_key_iterator first; // Key of the element.
+			element_iterator second; // Value of the element.
+			uint64_t serial = 0; // Nonzero if the element is tracked.
+			[[no_unique_address]] aggregate_slot<aggregate_policy> slot = {};
+		};
+
+		using element_list = node_list<element_entry>;
+		using element_list_iterator = element_list::iterator;
+		using chain_list = node_list<element_list_iterator>;
+		using key_compare = decltype([](element_by_key_iterator a,
+			element_by_key_iterator b) { return a->first < b->first; });
+		using key_traits = flat_key_traits<K>;
+		using key_index =
+			select_key_index<K, element_by_key_iterator>::type;
+
+		using chain_map =
+			node_map<element_by_key_iterator, chain_list, key_compare>;
+		using chain_iterator = typename chain_map::iterator;
+
+		// Where a tracked element is, so that it can be erased
+		// without searching.
+		struct tracked_element
+		{
+			element_list_iterator element;
+			chain_iterator chain;
+			typename chain_list::iterator position;
+		};
+		using tracked_map = std::unordered_map<uint64_t, tracked_element,
+			std::hash<uint64_t>, std::equal_to<uint64_t>,
+			node_allocator<pair<const uint64_t, tracked_element>>>;
+
+		element_map elements_by_key;
+		element_list elements;
+		chain_map key_to_list_map;
+		// Flat copy of the keys of elements_by_key, used for small
+		// stacks with integral keys.
+		[[no_unique_address]] key_index flat_keys;
+		// Optional filter over the keys of elements_by_key,
+		// used to reject lookups of absent keys.
+		std::unique_ptr<key_filter<K>> filter;
+		// Elements pushed with a handle, by serial number.
+		tracked_map tracked;
+		// Changes whenever keys are removed, so that key handles know
+		// their iterators may be gone. Each object counts on its own from
+		// a start of its own, so the value never repeats across objects.
+		uint64_t generation = first_generation();
+		// Node cache capacity set aside for this data, and the cache
+		// holding it.
+		size_t reserved_elements = 0;
+		size_t reserved_keys = 0;
+		node_cache::owner* reserving_cache = nullptr;
+
+		// Returns the first generation of a new object. Objects are 2^32
+		// generations apart, so removing keys never touches the counter.
+		static uint64_t first_generation() noexcept
+		{
+			static std::atomic<uint64_t> counter{ 0 };
+			return (counter.fetch_add(1, std::memory_order_relaxed) + 1) << 32;
+		}
+
+		// Returns a serial number for a tracked element, not used before.
+		static uint64_t next_serial() noexcept
+		{
+			static std::atomic<uint64_t> counter{ 0 };
+			return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+		}
+
+		stack_data(); // Empty constructor.
+		~stack_data(); // Gives the reserved node cache capacity back.
+
+		// Copy constructor used when we need to split memory.
+		stack_data(const stack_data& other);
+		// Copy constructor that also copies boxed values instead of
+		// sharing them, used when references to values may be out.
+		stack_data(const stack_data& other, bool bCloneValues);
+
+		// Returns an iterator to the key in elements_by_key, or end().
+		element_by_key_iterator find_key(K const& key);
+
+		// Returns whether find_key() goes through the flat key index.
+		bool has_flat_keys() const noexcept;
+
+		// Adds a key freshly inserted into elements_by_key to the index.
+		void index_key(element_by_key_iterator key_iter) noexcept;
+
+		// Removes the key from elements_by_key and from the index.
+		void erase_key(element_by_key_iterator key_iter) noexcept;
+
+		// Like erase_key(), but hands over the node of the key.
+		element_map::node_type extract_key(
+			element_by_key_iterator key_iter) noexcept;
+
+		// An element taken out of the data, with all its nodes. The
+		// nodes of its key are there too if it was the last one.
+		struct extracted_element
+		{
+			value_list value;
+			element_list entry;
+			chain_list chain;
+			element_map::node_type key_node;
+			chain_map::node_type chain_node;
+		};
+
+		// Moves the topmost element with the key into out, without
+		// allocating. The element stops being tracked.
+		void extract_key_top(element_by_key_iterator key_iter,
+			chain_iterator chain_iter, extracted_element& out) noexcept;
+
+		// Puts an extracted element on the top, under the given key.
+		// Allocates only if the key is new and its nodes aren't in.
+		void insert_extracted(K const& key, extracted_element& in);
+
+		// Moves all elements with the key from other on the top, in
+		// their order, relinking the nodes. They stop being tracked.
+		// If other is this data, the elements are just moved on the top.
+		void splice_key(stack_data& other,
+			element_by_key_iterator other_key_iter) noexcept;
+
+		// Moves the values and the chain of a key of other under the same
+		// key here, and removes the key from other. A new key takes over
+		// the key nodes. Doesn't move the elements themselves.
+		// Returns the chain of the key here.
+		chain_iterator adopt_key(stack_data& other,
+			element_by_key_iterator other_key_iter,
+			chain_iterator other_chain) noexcept;
+
+		// Marks the aggregates from the given place up to the top of the
+		// key as stale. Stale aggregates are always on the top of a key.
+		void stale_aggregates(chain_list& chain,
+			typename chain_list::iterator from) noexcept;
+
+		// Marks the aggregate of the top of the key, or of all its
+		// elements, as stale, before their values are handed out.
+		void stale_aggregates(element_by_key_iterator key_iter,
+			bool bIsWholeKey) noexcept;
+
+		// Recomputes the aggregates of the key from the given place up,
+		// starting lower if there are stale ones below.
+		void settle_aggregates(chain_iterator chain_iter,
+			typename chain_list::iterator from);
+
+		// Recomputes the stale aggregates on the top of the key, after
+		// nodes were relinked. If combine throws, they stay stale and
+		// reads compute them instead.
+		void settle_stale(chain_iterator chain_iter) noexcept;
+
+		// Returns the aggregate of all values of a key, without
+		// modifying anything.
+		auto key_aggregate(chain_list const& chain) const;
+
+		// Returns the entries of the greatest or of the smallest key.
+		// Both maps are in key order, so no lookup is needed.
+		pair<element_by_key_iterator, chain_iterator>
+			extreme_key(bool bIsMax) noexcept;
+
+		// Moves an element on the top, making it the top of its key too.
+		// position is where the element is in the chain list of its key.
+		void raise(element_list_iterator element, chain_iterator chain_iter,
+			typename chain_list::iterator position) noexcept;
+
+		// Moves all elements of other on the top, in their order,
+		// relinking the nodes, and leaves other empty. tracked must have
+		// room for the tracked elements of other.
+		void append(stack_data& other) noexcept;
+
+		// Moves the top depth elements into out, which must be empty.
+		// Throws before anything is moved if out can't get the keys.
+		void split_top(size_t depth, stack_data& out);
+
+		// Removes the topmost element with the key, given the entries
+		// of the key in elements_by_key and key_to_list_map.
+		void pop_key_top(element_by_key_iterator key_iter,
+			chain_iterator chain_iter) noexcept;
+
+		// Starts tracking the top element under the given serial.
+		void track_top(uint64_t serial);
+
+		// Removes a tracked element, wherever it is in the stack.
+		void erase_tracked(tracked_map::iterator tracked_iter) noexcept;
+
+		// Returns the node cache requests for the given numbers of
+		// elements and keys.
+		static std::array<pair<size_t, size_t>, 5> cache_requests(
+			size_t elements, size_t keys) noexcept;
+
+		// Caches enough nodes for the given numbers of elements and keys,
+		// set aside for this data until it's destroyed.
+		void reserve(size_t elements, size_t keys);
+
+		// Lets the node cache keep all nodes of this data once freed,
+		// until the data is destroyed.
+		void retain_nodes() noexcept;
+
+		// Records capacity set aside for this data in the cache of this
+		// thread. Returns false if that cache can't take any.
+		bool set_aside(size_t elements, size_t keys) noexcept;
+
+		// Gives the capacity set aside for this data back to the cache
+		// holding it, which may belong to another thread.
+		void release_reservation() noexcept;
+
+		// Returns the data shared by all empty stacks. It's never modified
+		// and holding it neither allocates nor touches a reference count.
+		static shared_ptr<stack_data> empty() noexcept;
+
+		// Returns empty data with the same key filter settings, which is
+		// the shared empty data if there is no filter.
+		shared_ptr<stack_data> make_empty() const;
+
+		// Like make_empty(), but the data is always new and unshared.
+		shared_ptr<stack_data> make_fresh() const;
+
+		// Builds the key filter sized for the given number of keys.
+		void enable_filter(size_t expected_keys);
+
+		// Removes all elements, keeping the key filter enabled.
+		void clear() noexcept;
+	};
+
+	template <typename K, typename V>
+	stack_data<K, V>::stack_data() : elements_by_key{},
+		elements{}, key_to_list_map{}
+	{}
+
+	template <typename K, typename V>
+	stack_data<K, V>::stack_data(const stack_data<K, V>& other)
+		: stack_data(other, false)
+	{}
+
+	template <typename K, typename V>
+	stack_data<K, V>::~stack_data()
+	{
+		release_reservation();
+	}
+
+	template <typename K, typename V>
+	stack_data<K, V>::stack_data(const stack_data<K, V>& other,
+		bool bCloneValues)
+		: elements_by_key{}, elements{}, key_to_list_map{},
+		filter{ other.filter ?
+			std::make_unique<key_filter<K>>(*other.filter) : nullptr }
+	{
+		// Code below inserts copy of every element from other.elements_by_key
+		// to this.elements_by_key, and after that, it creates iterators
+		// to those elements, and adds them to the rest of data structures.
+		for (auto iter = other.elements.begin();
+			iter != other.elements.end(); ++iter)
+		{
+			auto key_iter =
+				elements_by_key.try_emplace(iter->first->first).first;
+			if (bCloneValues)
+			{
+				key_iter->second.push_back(storage::clone(*(iter->second)));
+			}
+			else
+			{
+				key_iter->second.push_back(*(iter->second));
+			}
+			auto value_iter = key_iter->second.end();
+			--value_iter;
+			elements.push_back(element_entry{ key_iter, value_iter });
+			auto list_iter = elements.end();
+			--list_iter;
+			auto chain_iter = key_to_list_map.try_emplace(key_iter).first;
+			chain_iter->second.push_back(list_iter);
+			if (iter->serial != 0)
+			{
+				// The copy of a tracked element is tracked too.
+				auto position = chain_iter->second.end();
+				--position;
+				tracked.emplace(iter->serial,
+					tracked_element{ list_iter, chain_iter, position });
+				list_iter->serial = iter->serial;
+			}
+			list_iter->slot = iter->slot;
+		}
+		if constexpr (key_traits::enabled)
+		{
+			flat_keys.rebuild(elements_by_key, key_traits::to_word);
+		}
+	}
+
+	template <typename K, typename V>
+	inline stack_data<K, V>::element_by_key_iterator
+		stack_data<K, V>::find_key(K const& key)
+	{
+		if constexpr (key_traits::enabled)
+		{
+			if (flat_keys.active())
+			{
+				return flat_keys.find(key_traits::to_word(key),
+					elements_by_key.end());
+			}
+		}
+		if constexpr (hashable_key<K>)
+		{
+			if (filter && !filter->may_contain(key))
+			{
+				return elements_by_key.end();
+			}
+		}
+		return elements_by_key.find(key);
+	}
+
+	template <typename K, typename V>
+	inline bool stack_data<K, V>::has_flat_keys() const noexcept
+	{
+		if constexpr (key_traits::enabled)
+		{
+			return flat_keys.active();
+		}
+		return false;
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::index_key(
+		element_by_key_iterator key_iter) noexcept
+	{
+		if constexpr (key_traits::enabled)
+		{
+			flat_keys.insert(key_traits::to_word(key_iter->first), key_iter);
+		}
+		if constexpr (hashable_key<K>)
+		{
+			if (filter)
+			{
+				filter->insert(key_iter->first);
+			}
+		}
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::erase_key(
+		element_by_key_iterator key_iter) noexcept
+	{
+		extract_key(key_iter); // The node is freed right away.
+	}
+
+	template <typename K, typename V>
+	inline stack_data<K, V>::element_map::node_type
+		stack_data<K, V>::extract_key(element_by_key_iterator key_iter) noexcept
+	{
+		++generation;
+		if constexpr (hashable_key<K>)
+		{
+			if (filter)
+			{
+				filter->erase(key_iter->first);
+			}
+		}
+		if constexpr (key_traits::enabled)
+		{
+			if (flat_keys.active())
+			{
+				flat_keys.erase(key_traits::to_word(key_iter->first));
+			}
+			auto node = elements_by_key.extract(key_iter);
+			if (!flat_keys.active() &&
+				elements_by_key.size() <= flat_key_capacity / 2)
+			{
+				flat_keys.rebuild(elements_by_key, key_traits::to_word);
+			}
+			return node;
+		}
+		else
+		{
+			return elements_by_key.extract(key_iter);
+		}
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::extract_key_top(
+		element_by_key_iterator key_iter, chain_iterator chain_iter,
+		extracted_element& out) noexcept
+	{
+		auto position = chain_iter->second.end();
+		--position;
+		element_list_iterator element = *position;
+		if (element->serial != 0)
+		{
+			tracked.erase(element->serial);
+			element->serial = 0;
+		}
+		out.chain.splice(out.chain.end(), chain_iter->second, position);
+		out.entry.splice(out.entry.end(), elements, element);
+		out.value.splice(out.value.end(), key_iter->second, element->second);
+		if (chain_iter->second.empty())
+		{
+			out.chain_node = key_to_list_map.extract(chain_iter);
+		}
+		if (key_iter->second.empty())
+		{
+			out.key_node = extract_key(key_iter);
+		}
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::insert_extracted(K const& key,
+		extracted_element& in)
+	{
+		auto key_iter = find_key(key);
+		bool bIsNewKey = key_iter == elements_by_key.end();
+		if (bIsNewKey)
+		{
+			key_iter = in.key_node ?
+				elements_by_key.insert(move(in.key_node)).position :
+				elements_by_key.try_emplace(key).first;
+		}
+		auto chain_iter = key_to_list_map.find(key_iter);
+		if (chain_iter == key_to_list_map.end())
+		{
+			if (in.chain_node)
+			{
+				in.chain_node.key() = key_iter;
+				chain_iter = key_to_list_map.insert(
+					move(in.chain_node)).position;
+			}
+			else
+			{
+				try
+				{
+					chain_iter = key_to_list_map.try_emplace(key_iter).first;
+				}
+				catch (...)
+				{
+					elements_by_key.erase(key_iter);
+					throw;
+				}
+			}
+		}
+		if (bIsNewKey)
+		{
+			index_key(key_iter);
+		}
+		// Nothing below allocates: the nodes are relinked.
+		in.entry.front().first = key_iter;
+		key_iter->second.splice(key_iter->second.end(), in.value);
+		elements.splice(elements.end(), in.entry);
+		chain_iter->second.splice(chain_iter->second.end(), in.chain);
+		stale_aggregates(chain_iter->second, std::prev(chain_iter->second.end()));
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::enable_filter(size_t expected_keys)
+	{
+		static_assert(hashable_key<K>, "The key filter needs std::hash<K>.");
+		auto new_filter = std::make_unique<key_filter<K>>(
+			std::max(expected_keys, elements_by_key.size()));
+		for (auto const& entry : elements_by_key)
+		{
+			new_filter->insert(entry.first);
+		}
+		filter = move(new_filter);
+	}
+
+	template <typename K, typename V>
+	inline std::array<pair<size_t, size_t>, 5>
+		stack_data<K, V>::cache_requests(size_t elements, size_t keys) noexcept
+	{
+		return { {
+			{ list_node_size<typename storage::type>, elements },
+			{ list_node_size<typename element_list::value_type>, elements },
+			{ list_node_size<element_list_iterator>, elements },
+			{ tree_node_size<typename element_map::value_type>, keys },
+			{ tree_node_size<typename chain_map::value_type>, keys } } };
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::reserve(size_t elements, size_t keys)
+	{
+		// Recorded first, so that a partial reservation is given back too.
+		if (set_aside(elements, keys))
+		{
+			node_cache::reserve(cache_requests(elements, keys));
+		}
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::pop_key_top(element_by_key_iterator key_iter,
+		chain_iterator chain_iter) noexcept
+	{
+		element_list_iterator element = chain_iter->second.back();
+		if (element->serial != 0)
+		{
+			tracked.erase(element->serial);
+		}
+		chain_iter->second.pop_back();
+		// If there is nothing under the key, we can erase it.
+		if (chain_iter->second.empty())
+		{
+			key_to_list_map.erase(chain_iter);
+		}
+		else
+		{
+			// Values handed out by values() are settled here.
+			settle_stale(chain_iter);
+		}
+		elements.erase(element);
+		key_iter->second.pop_back();
+		if (key_iter->second.empty())
+		{
+			erase_key(key_iter);
+		}
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::track_top(uint64_t serial)
+	{
+		auto element = elements.end();
+		--element;
+		auto chain_iter = key_to_list_map.find(element->first);
+		auto position = chain_iter->second.end();
+		--position;
+		tracked.emplace(serial,
+			tracked_element{ element, chain_iter, position });
+		element->serial = serial;
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::erase_tracked(
+		tracked_map::iterator tracked_iter) noexcept
+	{
+		auto [element, chain_iter, position] = tracked_iter->second;
+		tracked.erase(tracked_iter);
+		stale_aggregates(chain_iter->second, std::next(position));
+		chain_iter->second.erase(position);
+		if (chain_iter->second.empty())
+		{
+			key_to_list_map.erase(chain_iter);
+		}
+		auto key_iter = element->first;
+		key_iter->second.erase(element->second);
+		elements.erase(element);
+		if (key_iter->second.empty())
+		{
+			erase_key(key_iter);
+		}
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::splice_key(stack_data& other,
+		element_by_key_iterator other_key_iter) noexcept
+	{
+		auto other_chain = other.key_to_list_map.find(other_key_iter);
+		for (element_list_iterator element : other_chain->second)
+		{
+			if (element->serial != 0 && &other != this)
+			{
+				other.tracked.erase(element->serial);
+				element->serial = 0;
+			}
+			elements.splice(elements.end(), other.elements, element);
+		}
+		if (&other == this)
+		{
+			return; // The key and its lists stay where they are.
+		}
+		adopt_key(other, other_key_iter, other_chain);
+	}
+
+	template <typename K, typename V>
+	inline stack_data<K, V>::chain_iterator stack_data<K, V>::adopt_key(
+		stack_data& other, element_by_key_iterator other_key_iter,
+		chain_iterator other_chain) noexcept
+	{
+		auto key_iter = find_key(other_key_iter->first);
+		if (key_iter == elements_by_key.end())
+		{
+			// Take over the nodes of the key with its lists. The key node
+			// keeps its address, so the elements still point at it.
+			auto chain_node = other.key_to_list_map.extract(other_chain);
+			key_iter = elements_by_key.insert(
+				other.extract_key(other_key_iter)).position;
+			chain_node.key() = key_iter;
+			index_key(key_iter);
+			return key_to_list_map.insert(move(chain_node)).position;
+		}
+		auto chain_iter = key_to_list_map.find(key_iter);
+		for (element_list_iterator element : other_chain->second)
+		{
+			element->first = key_iter;
+		}
+		// Their aggregates don't count the elements here.
+		stale_aggregates(other_chain->second, other_chain->second.begin());
+		key_iter->second.splice(key_iter->second.end(), other_key_iter->second);
+		chain_iter->second.splice(chain_iter->second.end(),
+			other_chain->second);
+		other.key_to_list_map.erase(other_chain);
+		other.erase_key(other_key_iter);
+		settle_stale(chain_iter);
+		return chain_iter;
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::stale_aggregates(chain_list& chain,
+		typename chain_list::iterator from) noexcept
+	{
+		if constexpr (aggregate_policy::enabled)
+		{
+			for (; from != chain.end(); ++from)
+			{
+				(*from)->slot.bIsStale = true;
+			}
+		}
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::stale_aggregates(
+		element_by_key_iterator key_iter, bool bIsWholeKey) noexcept
+	{
+		if constexpr (aggregate_policy::enabled)
+		{
+			auto& chain = key_to_list_map.find(key_iter)->second;
+			stale_aggregates(chain,
+				bIsWholeKey ? chain.begin() : std::prev(chain.end()));
+		}
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::settle_aggregates(chain_iterator chain_iter,
+		typename chain_list::iterator from)
+	{
+		if constexpr (aggregate_policy::enabled)
+		{
+			auto& chain = chain_iter->second;
+			while (from != chain.begin() && (*std::prev(from))->slot.bIsStale)
+			{
+				--from;
+			}
+			auto running = from == chain.begin() ?
+				aggregate_policy::identity() : (*std::prev(from))->slot.running;
+			for (; from != chain.end(); ++from)
+			{
+				auto& slot = (*from)->slot;
+				running = aggregate_policy::combine(running,
+					aggregate_policy::lift(storage::get(*(*from)->second)));
+				slot.running = running;
+				slot.bIsStale = false;
+			}
+		}
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::settle_stale(chain_iterator chain_iter) noexcept
+	{
+		if constexpr (aggregate_policy::enabled)
+		{
+			try
+			{
+				settle_aggregates(chain_iter, chain_iter->second.end());
+			}
+			catch (...)
+			{
+				// The ones not settled yet stay stale, on the top.
+			}
+		}
+	}
+
+	template <typename K, typename V>
+	inline auto stack_data<K, V>::key_aggregate(chain_list const& chain) const
+	{
+		auto from = chain.end();
+		while (from != chain.begin() && (*std::prev(from))->slot.bIsStale)
+		{
+			--from;
+		}
+		auto result = from == chain.begin() ?
+			aggregate_policy::identity() : (*std::prev(from))->slot.running;
+		for (; from != chain.end(); ++from)
+		{
+			result = aggregate_policy::combine(result,
+				aggregate_policy::lift(storage::get(*(*from)->second)));
+		}
+		return result;
+	}
+
+	template <typename K, typename V>
+	inline pair<typename stack_data<K, V>::element_by_key_iterator,
+		typename stack_data<K, V>::chain_iterator>
+		stack_data<K, V>::extreme_key(bool bIsMax) noexcept
+	{
+		if (bIsMax)
+		{
+			return { std::prev(elements_by_key.end()),
+				std::prev(key_to_list_map.end()) };
+		}
+		return { elements_by_key.begin(), key_to_list_map.begin() };
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::raise(element_list_iterator element,
+		chain_iterator chain_iter,
+		typename chain_list::iterator position) noexcept
+	{
+		auto key_iter = element->first;
+		stale_aggregates(chain_iter->second, position);
+		key_iter->second.splice(key_iter->second.end(), key_iter->second,
+			element->second);
+		chain_iter->second.splice(chain_iter->second.end(), chain_iter->second,
+			position);
+		elements.splice(elements.end(), elements, element);
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::append(stack_data& other) noexcept
+	{
+		// Both maps are in key order, so they're walked side by side.
+		auto other_key = other.elements_by_key.begin();
+		auto other_chain = other.key_to_list_map.begin();
+		while (other_key != other.elements_by_key.end())
+		{
+			auto next_key = std::next(other_key);
+			auto next_chain = std::next(other_chain);
+			adopt_key(other, other_key, other_chain);
+			other_key = next_key;
+			other_chain = next_chain;
+		}
+
+		for (auto& [serial, where] : other.tracked)
+		{
+			where.chain = key_to_list_map.find(where.element->first);
+		}
+		tracked.merge(other.tracked);
+		// Serials left behind are already tracked here, by copies of
+		// the same elements. Only those stay tracked.
+		for (auto& [serial, where] : other.tracked)
+		{
+			where.element->serial = 0;
+		}
+		elements.splice(elements.end(), other.elements);
+		other.clear();
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::split_top(size_t depth, stack_data& out)
+	{
+		auto first = elements.end();
+		std::advance(first, -static_cast<ptrdiff_t>(depth));
+		// Everything that allocates comes first.
+		size_t tracked_count = 0;
+		for (auto iter = first; iter != elements.end(); ++iter)
+		{
+			auto [key_iter, bIsNewKey] =
+				out.elements_by_key.try_emplace(iter->first->first);
+			if (bIsNewKey)
+			{
+				out.key_to_list_map.try_emplace(key_iter);
+				out.index_key(key_iter);
+			}
+			tracked_count += iter->serial != 0;
+		}
+		out.tracked.reserve(tracked_count);
+
+		out.elements.splice(out.elements.end(), elements, first,
+			elements.end());
+		// From the top down, every moved element is the top of its key.
+		for (auto iter = out.elements.end(); iter != out.elements.begin(); )
+		{
+			--iter;
+			auto key_iter = iter->first;
+			auto chain_iter = key_to_list_map.find(key_iter);
+			auto out_key = out.find_key(key_iter->first);
+			auto out_chain = out.key_to_list_map.find(out_key);
+			out_key->second.splice(out_key->second.begin(),
+				key_iter->second, iter->second);
+			auto position = chain_iter->second.end();
+			--position;
+			out_chain->second.splice(out_chain->second.begin(),
+				chain_iter->second, position);
+			iter->first = out_key;
+			if constexpr (aggregate_policy::enabled)
+			{
+				// The elements under it stay here.
+				iter->slot.bIsStale = true;
+			}
+			if (iter->serial != 0)
+			{
+				auto node = tracked.extract(iter->serial);
+				node.mapped().chain = out_chain;
+				out.tracked.insert(move(node));
+			}
+			if (chain_iter->second.empty())
+			{
+				key_to_list_map.erase(chain_iter);
+				erase_key(key_iter);
+			}
+		}
+		if constexpr (aggregate_policy::enabled)
+		{
+			for (auto out_chain = out.key_to_list_map.begin();
+				out_chain != out.key_to_list_map.end(); ++out_chain)
+			{
+				out.settle_stale(out_chain);
+			}
+		}
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::retain_nodes() noexcept
+	{
+		// Nodes already set aside for this data are counted in.
+		if (!set_aside(0, 0))
+		{
+			return;
+		}
+		size_t more_elements =
+			elements.size() - std::min(elements.size(), reserved_elements);
+		size_t more_keys = elements_by_key.size() -
+			std::min(elements_by_key.size(), reserved_keys);
+		set_aside(more_elements, more_keys);
+		node_cache::retain(cache_requests(more_elements, more_keys));
+	}
+
+	template <typename K, typename V>
+	inline bool stack_data<K, V>::set_aside(size_t elements,
+		size_t keys) noexcept
+	{
+		if (!node_cache::is_local(reserving_cache))
+		{
+			release_reservation();
+			reserving_cache = node_cache::hold_local();
+			if (reserving_cache == nullptr)
+			{
+				return false;
+			}
+		}
+		reserved_elements += elements;
+		reserved_keys += keys;
+		return true;
+	}
+
+	template <typename K, typename V>
+	inline void stack_data<K, V>::release_reservation() noexcept
 	{
-		using element_map = map<K, list<V>>;
-		using element_iterator = typename list<V>::iterator;
-		using element_by_key_iterator = typename element_map::iterator;
-		using element_list = list<pair<element_by_key_iterator, 
-			element_iterator>>;
-		using element_list_iterator = element_list::iterator;
-	public:
-		element_map elements_by_key;
-		element_list elements;
-		map < element_by_key_iterator, list<element_list_iterator>,
-			decltype([](element_by_key_iterator a, 
-				element_by_key_iterator b)
-				{ return a->first < b->first; }) > key_to_list_map;
+		if (reserving_cache == nullptr)
+		{
+			return;
+		}
+		node_cache::release(std::exchange(reserving_cache, nullptr),
+			cache_requests(reserved_elements, reserved_keys));
+		reserved_elements = 0;
+		reserved_keys = 0;
+	}
 
-		stack_data(); // Empty constructor.
-		~stack_data() = default; // Default destructor.
+	template <typename K, typename V>
+	inline shared_ptr<stack_data<K, V>> stack_data<K, V>::empty() noexcept
+	{
+		static stack_data* sentinel = new stack_data();
+		// Aliases no owner, so use_count() of the result is 0.
+		return shared_ptr<stack_data>(shared_ptr<stack_data>(), sentinel);
+	}
 
-		// Copy constructor used when we need to split memory.
-		stack_data(const stack_data& other);
-	};
+	template <typename K, typename V>
+	inline shared_ptr<stack_data<K, V>> stack_data<K, V>::make_empty() const
+	{
+		if (!filter)
+		{
+			return empty();
+		}
+		return make_fresh();
+	}
 
 	template <typename K, typename V>
-	stack_data<K, V>::stack_data() : elements_by_key{},
-		elements{}, key_to_list_map{}
-	{}
+	inline shared_ptr<stack_data<K, V>> stack_data<K, V>::make_fresh() const
+	{
+		auto result = make_node_shared<stack_data<K, V>>();
+		if (filter)
+		{
+			result->filter = std::make_unique<key_filter<K>>(*filter);
+			result->filter->clear();
+		}
+		return result;
+	}
 
 	template <typename K, typename V>
-	stack_data<K, V>::stack_data(const stack_data<K, V>& other)
-		: elements_by_key{}, elements{}, key_to_list_map{}
+	inline void stack_data<K, V>::clear() noexcept
 	{
-		// Code below inserts copy of every element from other.elements_by_key
-		// to this.elements_by_key, and after that, it creates iterators
-		// to those elements, and adds them to the rest of data structures.
-		for (auto iter = other.elements.begin();
-			iter != other.elements.end(); ++iter)
+		++generation;
+		tracked.clear();
+		elements.clear();
+		elements_by_key.clear();
+		key_to_list_map.clear();
+		if constexpr (key_traits::enabled)
 		{
-			auto map_pair = iter->first;
-			elements_by_key[map_pair->first].push_back(*(iter->second));
-			auto key_iter = elements_by_key.find(map_pair->first);
-			auto value_iter = elements_by_key[map_pair->first].end();
-			--value_iter;
-			elements.push_back(pair{ key_iter, value_iter });
-			auto list_iter = elements.end();
-			--list_iter;
-			key_to_list_map[key_iter].push_back(list_iter);
+			flat_keys.reset();
+		}
+		if (filter)
+		{
+			filter->clear();
 		}
 	}
 
 	template<typename Stack, typename StackData>
 	class modify_guard;
 
+	// Operations reported to the trace policy.
+	enum class stack_operation
+	{
+		push,
+		pop,
+		pop_key,
+		front,
+		front_key,
+		unshare, // Deep copy of shared data before a modification.
+		rollback, // Modification reverted after an exception.
+		copy_construct,
+		assign
+	};
+
+	inline constexpr size_t stack_operation_count =
+		static_cast<size_t>(stack_operation::assign) + 1;
+
+	struct stack_trace_event
+	{
+		stack_operation operation;
+		size_t key_hash; // 0 if the operation has no key.
+		size_t size; // Size of the stack after the operation.
+		uint64_t duration_ns;
+	};
+
+	// Clock used to time traced operations. It reads the time stamp
+	// counter where there is one, and converts ticks to nanoseconds
+	// with a ratio measured once against steady_clock. The ratio is
+	// measured while the program starts, never by a traced operation.
+	struct stack_clock
+	{
+		static uint64_t ticks() noexcept
+		{
+#if defined(CXX_STACK_HAS_TSC)
+			return __rdtsc();
+#else
+			return static_cast<uint64_t>(std::chrono::duration_cast<
+				std::chrono::nanoseconds>(std::chrono::steady_clock::now()
+					.time_since_epoch()).count());
+#endif
+		}
+
+		static uint64_t to_ns(uint64_t ticks) noexcept
+		{
+#if defined(CXX_STACK_HAS_TSC)
+			return static_cast<uint64_t>(ticks * calibration<>::ns_per_tick);
+#else
+			return ticks;
+#endif
+		}
+
+	private:
+		// Counts ticks during one millisecond of steady_clock.
+		static double calibrate() noexcept
+		{
+			using steady = std::chrono::steady_clock;
+			auto start = steady::now();
+			uint64_t start_ticks = ticks();
+			steady::time_point now;
+			do
+			{
+				now = steady::now();
+			} while (now - start < std::chrono::milliseconds(1));
+			uint64_t elapsed = ticks() - start_ticks;
+			auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+				now - start).count();
+			return elapsed == 0 ? 1.0 : static_cast<double>(ns) / elapsed;
+		}
+
+		// Initialized with the other globals of programs that use
+		// to_ns(), so only operations traced before main() see 0.
+		template <typename = void>
+		struct calibration
+		{
+			static inline double const ns_per_tick = calibrate();
+		};
+	};
+
+	// Log-linear latency histogram in the spirit of HdrHistogram. Values
+	// below 16 ns are exact, larger ones fall into 16 buckets per power
+	// of two, which keeps them with about 6% precision, up to 2^40 ns.
+	class latency_histogram
+	{
+	public:
+		static constexpr size_t sub_buckets = 16;
+		static constexpr size_t max_shift = 35;
+		static constexpr size_t buckets = (max_shift + 2) * sub_buckets;
+
+		static size_t index(uint64_t value) noexcept
+		{
+			if (value < sub_buckets)
+			{
+				return static_cast<size_t>(value);
+			}
+			size_t shift = std::min<size_t>(std::bit_width(value) - 5,
+				max_shift);
+			uint64_t top = std::min<uint64_t>(value >> shift,
+				2 * sub_buckets - 1);
+			return (shift + 1) * sub_buckets +
+				static_cast<size_t>(top - sub_buckets);
+		}
+
+		// Returns the highest value falling into the bucket.
+		static uint64_t highest_value(size_t index) noexcept
+		{
+			if (index < sub_buckets)
+			{
+				return index;
+			}
+			size_t shift = index / sub_buckets - 1;
+			uint64_t top = sub_buckets + index % sub_buckets;
+			return ((top + 1) << shift) - 1;
+		}
+
+		void add(size_t index, uint64_t count) noexcept
+		{
+			counts[index] += count;
+			total += count;
+		}
+
+		uint64_t count() const noexcept
+		{
+			return total;
+		}
+
+		// Returns the value below which the given percent of values fall.
+		uint64_t percentile(double percent) const noexcept
+		{
+			if (total == 0)
+			{
+				return 0;
+			}
+			double wanted = percent / 100.0 * static_cast<double>(total);
+			uint64_t rank = std::max<uint64_t>(1,
+				static_cast<uint64_t>(wanted + 0.999999));
+			uint64_t seen = 0;
+			for (size_t i = 0; i < buckets; ++i)
+			{
+				seen += counts[i];
+				if (seen >= rank)
+				{
+					return highest_value(i);
+				}
+			}
+			return highest_value(buckets - 1);
+		}
+
+		uint64_t max() const noexcept
+		{
+			return percentile(100.0);
+		}
+
+	private:
+		std::array<uint64_t, buckets> counts{};
+		uint64_t total = 0;
+	};
+
+	// Latency histograms of stack operations. Every thread records into
+	// its own histograms without locks; snapshot() merges all of them.
+	// Fed by stacks whose stack_trace_policy derives from
+	// metrics_trace_policy.
+	class stack_metrics
+	{
+	public:
+		using snapshot_type =
+			std::array<latency_histogram, stack_operation_count>;
+
+		static void record(stack_operation operation, uint64_t ns) noexcept
+		{
+			thread_local local_histograms local;
+			auto& counter = local.data->counts
+				[static_cast<size_t>(operation)]
+				[latency_histogram::index(ns)];
+			// Only this thread writes, so no read-modify-write is needed.
+			counter.store(counter.load(std::memory_order_relaxed) + 1,
+				std::memory_order_relaxed);
+		}
+
+		// Returns merged histograms of all threads, by operation.
+		static snapshot_type snapshot()
+		{
+			registry& all = global();
+			std::scoped_lock lock(all.mutex);
+			snapshot_type result = all.retired;
+			for (thread_histograms const* thread : all.threads)
+			{
+				for (size_t op = 0; op < stack_operation_count; ++op)
+				{
+					for (size_t i = 0; i < latency_histogram::buckets; ++i)
+					{
+						uint64_t count = thread->counts[op][i].load(
+							std::memory_order_relaxed);
+						if (count != 0)
+						{
+							result[op].add(i, count);
+						}
+					}
+				}
+			}
+			return result;
+		}
+
+		// Drops everything recorded so far.
+		static void reset() noexcept
+		{
+			registry& all = global();
+			std::scoped_lock lock(all.mutex);
+			all.retired = {};
+			for (thread_histograms* thread : all.threads)
+			{
+				for (auto& operation : thread->counts)
+				{
+					for (auto& counter : operation)
+					{
+						counter.store(0, std::memory_order_relaxed);
+					}
+				}
+			}
+		}
+
+	private:
+		struct thread_histograms
+		{
+			std::atomic<uint64_t> counts[stack_operation_count]
+				[latency_histogram::buckets]{};
+		};
+
+		struct registry
+		{
+			std::mutex mutex;
+			std::vector<thread_histograms*> threads;
+			snapshot_type retired{};
+		};
+
+		// Never destroyed, so threads may exit during static destruction.
+		static registry& global()
+		{
+			static registry* all = new registry();
+			return *all;
+		}
+
+		// Histograms of one thread, merged into retired when it exits.
+		struct local_histograms
+		{
+			thread_histograms* data = new thread_histograms();
+
+			local_histograms()
+			{
+				registry& all = global();
+				std::scoped_lock lock(all.mutex);
+				all.threads.push_back(data);
+			}
+
+			~local_histograms()
+			{
+				registry& all = global();
+				std::scoped_lock lock(all.mutex);
+				for (size_t op = 0; op < stack_operation_count; ++op)
+				{
+					for (size_t i = 0; i < latency_histogram::buckets; ++i)
+					{
+						uint64_t count = data->counts[op][i].load(
+							std::memory_order_relaxed);
+						if (count != 0)
+						{
+							all.retired[op].add(i, count);
+						}
+					}
+				}
+				std::erase(all.threads, data);
+				delete data;
+			}
+		};
+	};
+
+	// Trace policy feeding stack_metrics. To record stack<K, V>, e.g.:
+	//   template <> struct cxx::stack_trace_policy<int, int>
+	//       : cxx::metrics_trace_policy {};
+	struct metrics_trace_policy
+	{
+		static constexpr bool enabled = true;
+
+		static void on_event(stack_trace_event const& event) noexcept
+		{
+			stack_metrics::record(event.operation, event.duration_ns);
+		}
+	};
+
+	// Receives trace events of stack<K, V>. Disabled by default, in which
+	// case no tracing code is compiled in. To trace, specialize it with
+	// enabled = true and a static noexcept on_event(stack_trace_event),
+	// or derive the specialization from a ready policy below.
+	template <typename K, typename V>
+	struct stack_trace_policy
+	{
+		static constexpr bool enabled = false;
+
+		static void on_event(stack_trace_event const&) noexcept
+		{}
+	};
+
+#if defined(CXX_STACK_HAS_USDT)
+	// Trace policy firing the cxx_stack:operation USDT probe,
+	// for perf and bpftrace. Derive a stack_trace_policy from it.
+	struct usdt_trace_policy
+	{
+		static constexpr bool enabled = true;
+
+		static void on_event(stack_trace_event const& event) noexcept
+		{
+			DTRACE_PROBE4(cxx_stack, operation,
+				static_cast<int>(event.operation), event.key_hash,
+				event.size, event.duration_ns);
+		}
+	};
+#endif
+
+	// Measures an operation of Stack and reports it to its trace policy
+	// when destroyed. Empty when tracing is disabled.
+	template <typename Stack, bool = stack_trace_policy<
+		typename Stack::key_type, typename Stack::mapped_type>::enabled>
+	class trace_scope
+	{
+	public:
+		trace_scope(stack_operation, Stack const&) noexcept
+		{}
+
+		trace_scope(stack_operation, Stack const&,
+			typename Stack::key_type const&) noexcept
+		{}
+
+		static void instant(stack_operation, Stack const&) noexcept
+		{}
+	};
+
+	template <typename Stack>
+	class trace_scope<Stack, true>
+	{
+		using K = typename Stack::key_type;
+		using policy = stack_trace_policy<K, typename Stack::mapped_type>;
+		stack_operation operation;
+		Stack const& stack;
+		size_t key_hash = 0;
+		uint64_t start = stack_clock::ticks();
+	public:
+		trace_scope(stack_operation operation, Stack const& stack) noexcept
+			: operation(operation), stack(stack)
+		{}
+
+		trace_scope(stack_operation operation, Stack const& stack,
+			K const& key) noexcept
+			: operation(operation), stack(stack)
+		{
+			if constexpr (hashable_key<K>)
+			{
+				key_hash = std::hash<K>{}(key);
+			}
+		}
+
+		~trace_scope()
+		{
+			uint64_t duration = stack_clock::to_ns(stack_clock::ticks() - start);
+			policy::on_event({ operation, key_hash, stack.size(), duration });
+		}
+
+		// Reports an operation that takes no time of its own.
+		static void instant(stack_operation operation,
+			Stack const& stack) noexcept
+		{
+			policy::on_event({ operation, 0, stack.size(), 0 });
+		}
+	};
+
+	// Bidirectional iterator showing an iterator of the underlying
+	// containers through a projection, e.g. as a key or (key, value) pair.
+	// Projections returning a pair by value make it a proxy iterator,
+	// which models std::bidirectional_iterator but not the legacy one.
+	template <typename Base, typename Projection>
+	class stack_iterator
+	{
+	public:
+		using reference = decltype(Projection{}(std::declval<Base const&>()));
+		using value_type = std::conditional_t<std::is_reference_v<reference>,
+			std::remove_cvref_t<reference>, reference>;
+		using difference_type = ptrdiff_t;
+		using pointer = std::conditional_t<std::is_reference_v<reference>,
+			std::add_pointer_t<reference>, void>;
+		using iterator_concept = std::bidirectional_iterator_tag;
+		using iterator_category = std::conditional_t<
+			std::is_reference_v<reference>,
+			std::bidirectional_iterator_tag, std::input_iterator_tag>;
+
+	private:
+		Base ptr{};
+
+	public:
+		stack_iterator() = default; // Empty constructor.
+
+		// Constructor that takes an iterator of the underlying container.
+		explicit stack_iterator(Base p) : ptr(p)
+		{}
+
+		// Conversion from the mutable counterpart.
+		template <typename Other, typename OtherProjection>
+			requires (std::convertible_to<Other, Base> &&
+				!std::same_as<Other, Base>)
+		stack_iterator(stack_iterator<Other, OtherProjection> const& other)
+			: ptr(other.base())
+		{}
+
+		Base const& base() const noexcept
+		{
+			return ptr;
+		}
+
+		reference operator*() const
+			noexcept(noexcept(Projection{}(std::declval<Base const&>())))
+		{
+			return Projection{}(ptr);
+		}
+
+		pointer operator->() const noexcept
+			requires std::is_reference_v<reference>
+		{
+			return &Projection{}(ptr);
+		}
+
+		stack_iterator& operator++() noexcept // ++iterator;
+		{
+			++ptr;
+			return *this;
+		}
+
+		stack_iterator operator++(int) noexcept // iterator++
+		{
+			stack_iterator result(*this);
+			operator++();
+			return result;
+		}
+
+		stack_iterator& operator--() noexcept // --iterator;
+		{
+			--ptr;
+			return *this;
+		}
+
+		stack_iterator operator--(int) noexcept // iterator--
+		{
+			stack_iterator result(*this);
+			operator--();
+			return result;
+		}
+
+		bool operator==(const stack_iterator& other) const noexcept
+		{
+			return ptr == other.ptr;
+		}
+	};
+
+	// Background thread destroying data let go of by stacks, so that
+	// freeing millions of nodes doesn't stall the thread that dropped
+	// the last reference. The queue is bounded: when it's full, retire()
+	// refuses and the caller destroys the data itself.
+	class stack_reclaimer
+	{
+		std::mutex mutex;
+		std::condition_variable wakeup;
+		std::condition_variable idle;
+		// Both reserved up front, so retiring never allocates.
+		std::vector<shared_ptr<void>> queue;
+		std::vector<shared_ptr<void>> batch;
+		size_t pending = 0; // Queued or being destroyed.
+		std::jthread worker;
+
+		explicit stack_reclaimer(size_t capacity)
+		{
+			queue.reserve(capacity);
+			batch.reserve(capacity);
+			worker = std::jthread([this](std::stop_token) { run(); });
+		}
+
+		void run()
+		{
+			for (;;)
+			{
+				std::unique_lock lock(mutex);
+				wakeup.wait(lock, [this] { return !queue.empty(); });
+				batch.swap(queue);
+				lock.unlock();
+				size_t count = batch.size();
+				batch.clear(); // Destroys the data.
+				// Don't keep the freed nodes, no stack lives here.
+				node_cache::trim();
+				lock.lock();
+				pending -= count;
+				if (pending == 0)
+				{
+					idle.notify_all();
+				}
+			}
+		}
+	public:
+		static constexpr size_t default_capacity = 64;
+
+		// The reclaimer is never destroyed, data still queued at exit
+		// is left to the operating system.
+		static stack_reclaimer& global()
+		{
+			static stack_reclaimer* reclaimer =
+				new stack_reclaimer(default_capacity);
+			return *reclaimer;
+		}
+
+		// Queues the data for destruction. Returns false, leaving data
+		// untouched, if the queue is full.
+		bool retire(shared_ptr<void>& data) noexcept
+		{
+			{
+				std::scoped_lock lock(mutex);
+				if (queue.size() == queue.capacity())
+				{
+					return false;
+				}
+				queue.push_back(move(data));
+				++pending;
+			}
+			wakeup.notify_one();
+			return true;
+		}
+
+		// Waits until everything retired so far is destroyed.
+		void drain()
+		{
+			std::unique_lock lock(mutex);
+			idle.wait(lock, [this] { return pending == 0; });
+		}
+	};
+
+	// Decides how stack<K, V> frees data it was the last owner of.
+	// By default it's freed in place. Specialize it with enabled = true
+	// to hand data of at least min_elements elements to the reclaimer
+	// thread. Destructors of K and V then run on that thread.
+	template <typename K, typename V>
+	struct stack_reclaim_policy
+	{
+		static constexpr bool enabled = false;
+		static constexpr size_t min_elements = 0;
+	};
+
 	template <typename K, typename V> class stack
 	{
 		// Shared pointer that owns the stack_data object with our data.
@@ -84,30 +2728,90 @@ namespace cxx
 		// Guard used to guarantee strong-exception guarantee.
 		friend modify_guard<stack<K, V>, stack_data<K, V>>;
 	public:
+		using key_type = K;
+		using mapped_type = V;
+		// Type keys can also be looked up by, see key_lookup_traits.
+		using lookup_key_type = typename key_lookup_traits<K>::query;
+
 		stack(); // Empty constructor.
+		// Empty constructor with the capacity hints of reserve().
+		stack(size_t elements, size_t keys);
 		stack(stack const&); // Copy constructor;
-		stack(stack&&) noexcept; // Move constructor;
-		~stack() noexcept = default; // Default destructor.
+		// Move constructor. The moved-from stack is left empty.
+		stack(stack&&) noexcept;
+		~stack() noexcept; // Destructor.
+
+		stack& operator=(stack const&); // Assignment operator.
+		// Move assignment operator. The moved-from stack is left empty.
+		stack& operator=(stack&&) noexcept;
+
+		// Exchanges the contents of two stacks.
+		void swap(stack&) noexcept;
 
-		stack& operator=(stack); // Assignment operator.
+		friend void swap(stack& a, stack& b) noexcept
+		{
+			a.swap(b);
+		}
 
 		// Pushes an element on the top of the stack.
 		void push(K const&, V const&); 
 
+		// Like push(), but returns a handle for erase().
+		element_handle push_with_handle(K const&, V const&);
+
+		// Removes the element with the given handle, wherever it is.
+		void erase(element_handle);
+
+		// Returns whether the element with the given handle is in the stack.
+		bool contains(element_handle) const noexcept;
+
 		// Pops the top element from the stack.
 		void pop();
 
 		// Pops the element closest to the top with the given key
 		// from the stack.
 		void pop(K const&);
+		void pop(lookup_key_type const&)
+			requires key_lookup_traits<K>::enabled;
 
-		// Clears all data structures.
+		// Clears all data structures. If the data is shared, the stack
+		// just lets go of it, without copying anything.
 		void clear();
 
+		// Like clear(), but the freed nodes are kept in the node cache
+		// of this thread, so refilling the stack doesn't allocate. They
+		// stay there until the data of the stack is destroyed.
+		void clear_retain();
+
+		// Prepares node capacity for the given numbers of elements and
+		// distinct keys, so that pushes don't have to allocate. Nodes are
+		// cached per thread, so they serve pushes made by this thread.
+		// The capacity is given back when the data of the stack is
+		// destroyed. Stacks that never reserve don't cache nodes.
+		void reserve(size_t elements, size_t keys);
+
+		// Rebuilds the data in freshly allocated nodes, laid out in stack
+		// order, and frees the old ones once no other stack shares them.
+		// Order and keys are kept. References returned by front() and
+		// iterators obtained before the call are invalidated. Capacity
+		// reserved for the stack is given back to the node cache.
+		void compact();
+
+		// Keeps an approximate filter of the keys, so that lookups of
+		// absent keys are usually answered without a tree descent.
+		// The filter is sized for the given number of distinct keys.
+		void enable_key_filter(size_t expected_keys);
+
 		// Returns the size of the stack.
 		size_t size() const noexcept;
 		// Returns the number of elements with the given key.
 		size_t count(K const&) const noexcept;
+		size_t count(lookup_key_type const&) const
+			requires key_lookup_traits<K>::enabled;
+		// Returns every key with its number of elements, in key order.
+		std::vector<std::pair<K, size_t>> counts() const;
+		// Returns the number of elements for each of the given keys.
+		std::vector<size_t> count_many(std::span<const K>) const;
 
 		// Returns the top of the stack with an option to modify its value.
 		std::pair<K const&, V&> front();
@@ -116,99 +2820,282 @@ namespace cxx
 
 		// Returns the first value with the given key. It can be modified.
 		V& front(K const&);
+		V& front(lookup_key_type const&)
+			requires key_lookup_traits<K>::enabled;
 		// Returns the first value with the given key.
 		V const& front(K const&) const;
+		V const& front(lookup_key_type const&) const
+			requires key_lookup_traits<K>::enabled;
 
-	public:
-		// Custom iterator for the stack class.
-		class const_iterator
+		// Return the element closest to the top with the greatest or the
+		// smallest key. The value can be modified.
+		std::pair<K const&, V&> front_max_key() { return front_extreme(true); }
+		std::pair<K const&, V&> front_min_key() { return front_extreme(false); }
+		// Return the element closest to the top with the greatest or the
+		// smallest key.
+		std::pair<K const&, V const&> front_max_key() const
+		{
+			return front_extreme(true);
+		}
+		std::pair<K const&, V const&> front_min_key() const
 		{
-		public:
-			// Necessary tags.
-			using iterator_category = forward_iterator_tag;
-			using value_type = K;
-			using difference_type = ptrdiff_t;
-			using pointer = const value_type*;
-			using reference = const value_type&;
+			return front_extreme(false);
+		}
 
-		private:
-			map<K, list<V>>::iterator ptr;
+		// Pop the element closest to the top with the greatest or the
+		// smallest key.
+		void pop_max_key() { pop_extreme(true); }
+		void pop_min_key() { pop_extreme(false); }
 
-		public:
-			const_iterator() : ptr(data_wrapper->elements_by_key.end())
-			{} // Empty constructor.
+		// Returns the aggregate of the values with the given key, from the
+		// bottom up, or the identity if there are none. Takes constant
+		// time after the lookup, unless values were handed out for
+		// modification since the last push of the key.
+		auto aggregate(K const&) const
+			requires stack_aggregate_policy<K, V>::enabled;
+		// Returns the aggregates of all keys combined in key order, which
+		// is the aggregate of the whole stack if combine is commutative.
+		auto aggregate() const
+			requires stack_aggregate_policy<K, V>::enabled;
 
-			const_iterator(map<K, list<V>>::iterator p) : ptr(p)
-			{} // constructor that takes an iterator to the element in the
-			// elements_by_key map.
+		// Calls fn(key, value) for every element. Unless the policy is
+		// sequenced, the keys are split between threads, so the order of
+		// calls is unspecified. Elements aren't copied and the data is only
+		// read, so it's safe even if other stacks share it.
+		template <typename ExecutionPolicy, typename Function>
+			requires execution_policy<std::remove_cvref_t<ExecutionPolicy>>
+		void for_each(ExecutionPolicy&&, Function fn) const;
 
-			const_iterator(const const_iterator& ci) : ptr(ci.ptr)
-			{} // Copy constructor.
+		// Reduces transform(key, value) of every element together with
+		// init, like std::transform_reduce. The reduction must be
+		// associative and commutative. Threads are used like in for_each.
+		template <typename ExecutionPolicy, typename T,
+			typename Reduce, typename Transform>
+			requires execution_policy<std::remove_cvref_t<ExecutionPolicy>>
+		T transform_reduce(ExecutionPolicy&&, T init,
+			Reduce reduce, Transform transform) const;
 
-			const_iterator(const_iterator&& ci) : ptr(std::move(ci.ptr)) 
-			{} // Move constructor.
+	private:
+		std::pair<K const&, V&> front_extreme(bool bIsMax);
+		std::pair<K const&, V const&> front_extreme(bool bIsMax) const;
+		void pop_extreme(bool bIsMax);
 
-			reference operator*() const noexcept
-			{
-				return ptr->first;
-			}
+		// Lets go of data, leaving it to the reclaimer thread
+		// if the reclaim policy asks for it.
+		static void release(shared_ptr<stack_data<K, V>> data) noexcept;
 
-			pointer operator->() const noexcept
-			{
-				return &ptr->first;
-			}
+		// Splits the keys into ranges holding similar numbers of elements
+		// and calls task(part, first, last) for each range, every one on
+		// its own thread if bIsParallel. Returns the number of ranges.
+		// A single key is never split, so one huge key limits the speedup.
+		template <typename Task>
+		size_t run_partitioned(bool bIsParallel, size_t parts_limit,
+			Task task) const;
+
+		// Returns whether the policy asks for more than one thread.
+		template <typename ExecutionPolicy>
+		static constexpr bool is_parallel_policy()
+		{
+			return std::is_same_v<std::remove_cvref_t<ExecutionPolicy>,
+				execution::parallel_policy>;
+		}
 
-			const_iterator& operator=(const const_iterator& ci)
+		struct key_projection
+		{
+			template <typename Iter>
+			K const& operator()(Iter const& iter) const noexcept
 			{
-				ptr = ci.ptr;
-				return *this;
+				return iter->first;
 			}
+		};
 
-			const_iterator& operator++() noexcept // ++iterator;
+		using storage = typename stack_data<K, V>::storage;
+
+		// Returns the value kept in stored, copying a shared box
+		// first if the value may be modified.
+		template <typename Stored>
+		static decltype(auto) stored_value(Stored& stored)
+			noexcept(!value_storage_traits<V>::out_of_line ||
+				std::is_const_v<Stored>)
+		{
+			if constexpr (std::is_const_v<Stored>)
 			{
-				++ptr;
-				return *this;
+				return storage::get(stored);
 			}
-
-			const_iterator operator++(int) noexcept // iterator++
+			else
 			{
-				const_iterator result(*this);
-				operator++();
-				return result;
+				return storage::get_mut(stored);
 			}
+		}
 
-			bool operator==(const const_iterator& other) const noexcept
+		struct value_projection
+		{
+			template <typename Iter>
+			decltype(auto) operator()(Iter const& iter) const
+				noexcept(noexcept(stored_value(*iter)))
 			{
-				return ptr == other.ptr;
+				return stored_value(*iter);
 			}
+		};
 
-			bool operator!= (const const_iterator& other) const noexcept
+		template <typename ValueRef>
+		struct element_projection
+		{
+			template <typename Iter>
+			pair<K const&, ValueRef> operator()(Iter const& iter) const
+				noexcept(std::is_const_v<std::remove_reference_t<ValueRef>> ||
+					!value_storage_traits<V>::out_of_line)
 			{
-				return !(*this == other);
+				if constexpr (std::is_const_v<std::remove_reference_t<ValueRef>>)
+				{
+					return { iter->first->first, storage::get(*iter->second) };
+				}
+				else
+				{
+					return { iter->first->first,
+						storage::get_mut(*iter->second) };
+				}
 			}
 		};
 
+	public:
+		// Iterators over the keys, in ascending order.
+		using const_iterator = stack_iterator<
+			typename stack_data<K, V>::element_map::const_iterator,
+			key_projection>;
+		using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+		// Iterators over the values of one key, from the bottom.
+		using value_iterator = stack_iterator<
+			typename stack_data<K, V>::value_list::iterator,
+			value_projection>;
+		using const_value_iterator = stack_iterator<
+			typename stack_data<K, V>::value_list::const_iterator,
+			value_projection>;
+		using reverse_value_iterator = std::reverse_iterator<value_iterator>;
+		using const_reverse_value_iterator =
+			std::reverse_iterator<const_value_iterator>;
+
+		// Iterators over (key, value) pairs in stack order, from the bottom.
+		using element_iterator = stack_iterator<
+			typename stack_data<K, V>::element_list::iterator,
+			element_projection<V&>>;
+		using const_element_iterator = stack_iterator<
+			typename stack_data<K, V>::element_list::const_iterator,
+			element_projection<V const&>>;
+		using reverse_element_iterator =
+			std::reverse_iterator<element_iterator>;
+		using const_reverse_element_iterator =
+			std::reverse_iterator<const_element_iterator>;
+
 		const_iterator cbegin() const noexcept
 		{
-			auto map_beg = data_wrapper->elements_by_key.begin();
-			return const_iterator(map_beg);
+			return const_iterator(data_wrapper->elements_by_key.cbegin());
 		}
 
 		const_iterator cend() const noexcept
 		{
-			auto map_end = data_wrapper->elements_by_key.end();
-			return const_iterator(map_end);
+			return const_iterator(data_wrapper->elements_by_key.cend());
+		}
+
+		const_iterator begin() const noexcept { return cbegin(); }
+		const_iterator end() const noexcept { return cend(); }
+
+		const_reverse_iterator crbegin() const noexcept
+		{
+			return const_reverse_iterator(cend());
+		}
+
+		const_reverse_iterator crend() const noexcept
+		{
+			return const_reverse_iterator(cbegin());
 		}
+
+		// Returns the values with the given key. Empty if there are none.
+		std::ranges::subrange<const_value_iterator> values(K const&) const;
+		std::ranges::subrange<const_value_iterator> values(
+			lookup_key_type const&) const
+			requires key_lookup_traits<K>::enabled;
+		std::ranges::subrange<const_value_iterator> cvalues(K const& key) const
+		{
+			return values(key);
+		}
+		// Returns the values with the given key, allowing to modify them.
+		// Like front(), this makes the stack stop sharing its data.
+		std::ranges::subrange<value_iterator> values(K const&);
+		std::ranges::subrange<value_iterator> values(lookup_key_type const&)
+			requires key_lookup_traits<K>::enabled;
+
+		// Returns all elements in stack order.
+		std::ranges::subrange<const_element_iterator> elements() const;
+		std::ranges::subrange<const_element_iterator> celements() const
+		{
+			return elements();
+		}
+		// Returns all elements in stack order, allowing to modify values.
+		// Like front(), this makes the stack stop sharing its data.
+		std::ranges::subrange<element_iterator> elements();
+
+		class node_type;
+		// Removes the top element and returns it together with its nodes.
+		node_type extract();
+		// Removes the element closest to the top with the given key and
+		// returns it together with its nodes.
+		node_type extract(K const&);
+		// Pushes an extracted element, reusing its nodes, so neither an
+		// allocation nor a copy of the value is needed unless the key is
+		// new here. Empty nodes are ignored.
+		void insert(node_type&&);
+
+		// Moves all elements with the given key from other on the top of
+		// this stack, in their order, relinking instead of copying them.
+		// Elements moved from another stack lose their handles.
+		void splice_key(stack& other, K const& key);
+
+		// Moves the element closest to the top with the given key on the
+		// top of the stack, without copying it.
+		void touch(K const&);
+		// Moves the element with the given handle on the top of the stack.
+		// It becomes the element closest to the top with its key, too.
+		void touch(element_handle);
+
+		// Moves all elements of other on the top of this stack, in their
+		// order, relinking instead of copying them. other is left empty.
+		// Handles move with their elements. If both stacks hold copies of
+		// the same tracked element, only the copy that was in this stack
+		// stays tracked.
+		void append(stack&& other);
+
+		// Removes the top depth elements and returns them as a new stack.
+		stack split_at(size_t depth);
+
+		class key_handle_type;
+		// Returns a handle to the entry of the key, so that repeated
+		// operations on the key skip the key lookups. The key doesn't
+		// have to be in the stack.
+		key_handle_type key_handle(K const&);
+		// Same, for a key given by its lookup type. The key is made only
+		// when the handle pushes it or is asked for it.
+		key_handle_type key_handle(lookup_key_type const&)
+			requires key_lookup_traits<K>::enabled;
 	};
 
 	template<typename K, typename V>
 	stack<K, V>::stack()
-		: data_wrapper{ make_shared<stack_data<K, V>>() }
+		: data_wrapper{ stack_data<K, V>::empty() }
 	{}
 
+	template<typename K, typename V>
+	stack<K, V>::stack(size_t elements, size_t keys)
+		: data_wrapper{ stack_data<K, V>::empty() }
+	{
+		reserve(elements, keys);
+	}
+
 	template<typename K, typename V>
 	stack<K, V>::stack(stack const& other)
 	{
+		trace_scope<stack> trace(stack_operation::copy_construct, other);
 		if (other.bIsShareable)
 		{
 			// This will increment the ref_count.
@@ -216,16 +3103,55 @@ namespace cxx
 		}
 		else
 		{
-			//Create new data object.
-			data_wrapper = make_shared<stack_data<K, V>>(*other.data_wrapper);
+			//Create new data object. The other stack may have handed out
+			// references to its values, so boxed values are copied too.
+			data_wrapper =
+				make_node_shared<stack_data<K, V>>(*other.data_wrapper, true);
 		}
 	}
 
 	template<typename K, typename V>
 	inline stack<K, V>::stack(stack&& other) noexcept
-		: data_wrapper{ move(other.data_wrapper) }
+		: data_wrapper{ std::exchange(other.data_wrapper,
+			stack_data<K, V>::empty()) },
+		bIsShareable{ std::exchange(other.bIsShareable, true) }
 	{}
 
+	template<typename K, typename V>
+	inline stack<K, V>::~stack() noexcept
+	{
+		release(move(data_wrapper));
+	}
+
+	template<typename K, typename V>
+	inline void stack<K, V>::release(shared_ptr<stack_data<K, V>> data)
+		noexcept
+	{
+		using policy = stack_reclaim_policy<K, V>;
+		if constexpr (policy::enabled)
+		{
+			// Only the last owner frees anything.
+			if (data.use_count() == 1 &&
+				data->elements.size() >= policy::min_elements)
+			{
+				try
+				{
+					shared_ptr<void> erased = move(data);
+					if (!stack_reclaimer::global().retire(erased))
+					{
+						// Queue full: destroy here, slowing the caller
+						// down instead of piling up garbage.
+						erased.reset();
+					}
+				}
+				catch (...)
+				{
+					// The thread couldn't be started, data is freed here.
+				}
+			}
+		}
+	}
+
 	static bool map_access_throw = false;
 	static bool push_back_throw = false;
 	static bool modify_guard_throw = false;
@@ -249,6 +3175,23 @@ namespace cxx
 			rollback = p.second;
 		}
 
+		// Constructor reusing the result of an earlier lookup. The key
+		// is inserted only if found is the end of the map.
+		map_access_guard(Map& map, K const& key, Map::iterator found)
+			: map(map)
+		{
+			if (map_access_throw) throw std::bad_alloc();
+			if (found != map.end())
+			{
+				it = found;
+				rollback = false;
+				return;
+			}
+			auto p = map.insert({ key, V() });
+			it = p.first;
+			rollback = p.second;
+		}
+
 		// Destructor.
 		~map_access_guard()
 		{
@@ -284,11 +3227,12 @@ namespace cxx
 		Container& container;
 	public:
 		// COnstructor.
-		push_back_guard(Container& container, V const& value)
+		template <typename U>
+		push_back_guard(Container& container, U&& value)
 			: container(container)
 		{
 			if (push_back_throw) throw std::bad_alloc();
-			container.push_back(value);
+			container.push_back(std::forward<U>(value));
 			rollback = true;
 		}
 
@@ -324,46 +3268,537 @@ namespace cxx
 			this->rollback = true;
 			this->data = stack.data_wrapper;
 			this->bIsShareable = stack.bIsShareable;
-			if (stack.data_wrapper.use_count() > 2 && bIsShareable)
+			long owners = stack.data_wrapper.use_count();
+			if (owners == 0)
+			{
+				// No owners means the shared empty data, which stays intact.
+				stack.data_wrapper = make_node_shared<StackData>();
+			}
+			else if (owners > 2 && bIsShareable)
 			{
 				// Make new wrapper. This should make the previous
 				// wrapper object to go out of scope and call its 
 				// destructor (RAII).
+				trace_scope<Stack> trace(stack_operation::unshare, stack);
 				stack.data_wrapper =
-					make_shared<StackData>(*stack.data_wrapper);
+					make_node_shared<StackData>(*stack.data_wrapper);
 			}
 			stack.bIsShareable = bIsStillShareable ? true : false;
 		}
 
-		// Destructor.
-		~modify_guard()
+		// Destructor.
+		~modify_guard()
+		{
+			if (rollback)
+			{
+				stack.bIsShareable = bIsShareable;
+				stack.data_wrapper = data;
+				trace_scope<Stack>::instant(stack_operation::rollback, stack);
+			}
+		}
+
+		// Returns whether the stack got its own copy of the data,
+		// which invalidates iterators found before the guard.
+		bool split() const noexcept
+		{
+			return stack.data_wrapper != data;
+		}
+
+		// Marks the fact that we don't want to revert changes.
+		void drop_rollback()
+		{
+			rollback = false;
+		}
+	};
+
+	// Operations on one key of a stack. The handle keeps iterators to
+	// the entries of the key, so as long as the data isn't copied and no
+	// key is removed, its operations take constant time. Otherwise the
+	// key is looked up again. Like an iterator, a handle must not
+	// outlive its stack, nor be used after the stack is moved.
+	template<typename K, typename V>
+	class stack<K, V>::key_handle_type
+	{
+		using data_type = stack_data<K, V>;
+
+		stack& owner;
+		// Empty while a key given by its lookup type isn't found.
+		std::optional<K> key_value;
+		[[no_unique_address]] lookup_key_type lookup_value;
+		// The data the iterators point into, and its generation then.
+		data_type* data = nullptr;
+		uint64_t generation = 0;
+		bool bIsFound = false;
+		data_type::element_by_key_iterator key_iter;
+		data_type::chain_iterator chain_iter;
+
+		// Looks the key up again if the iterators may be stale.
+		// Returns whether the key is in the stack.
+		bool refresh()
+		{
+			if constexpr (key_lookup_traits<K>::enabled)
+			{
+				if (!key_value)
+				{
+					key_value = key_lookup_traits<K>::find(lookup_value);
+				}
+			}
+			if (!key_value)
+			{
+				return false; // Never made, so no stack has it.
+			}
+			data_type* current = owner.data_wrapper.get();
+			if (bIsFound && current == data &&
+				current->generation == generation)
+			{
+				return true;
+			}
+			data = current;
+			generation = current->generation;
+			key_iter = current->find_key(*key_value);
+			bIsFound = key_iter != current->elements_by_key.end();
+			if (bIsFound)
+			{
+				chain_iter = current->key_to_list_map.find(key_iter);
+			}
+			return bIsFound;
+		}
+
+		// Throws unless the key is in the stack.
+		void require()
+		{
+			if (!refresh())
+			{
+				throw std::invalid_argument
+				("There's no element with the given key in the stack.");
+			}
+		}
+	public:
+		key_handle_type(stack& owner, K const& key)
+			: owner(owner), key_value(key)
+		{}
+
+		key_handle_type(stack& owner, lookup_key_type const& key)
+			requires key_lookup_traits<K>::enabled
+			: owner(owner), lookup_value(key)
+		{}
+
+		// Returns the key, making it if it was given by its lookup type.
+		K const& key()
+		{
+			if constexpr (key_lookup_traits<K>::enabled)
+			{
+				if (!key_value)
+				{
+					key_value.emplace(lookup_value);
+				}
+			}
+			return *key_value;
+		}
+
+		// Returns the number of elements with the key.
+		size_t count()
+		{
+			return refresh() ? key_iter->second.size() : 0;
+		}
+
+		// Pushes an element with the key on the top of the stack.
+		void push(V const& value)
+		{
+			if (!refresh())
+			{
+				// A new key takes the usual way in.
+				owner.push(key(), value);
+				return;
+			}
+			trace_scope<stack> trace(stack_operation::push, owner, *key_value);
+			modify_guard<stack<K, V>, data_type> guard(owner, true);
+			if (guard.split())
+			{
+				refresh();
+			}
+			push_back_guard push_value(
+				key_iter->second,
+				data_type::storage::make(value)
+			);
+			auto value_iter = key_iter->second.end();
+			--value_iter;
+			push_back_guard push_element(
+				data->elements,
+				typename data_type::element_entry{ key_iter, value_iter }
+			);
+			auto list_iter = data->elements.end();
+			--list_iter;
+			push_back_guard push_list(chain_iter->second, list_iter);
+			auto position = chain_iter->second.end();
+			--position;
+			data->settle_aggregates(chain_iter, position);
+			guard.drop_rollback();
+			push_value.drop_rollback();
+			push_element.drop_rollback();
+			push_list.drop_rollback();
+		}
+
+		// Pops the element closest to the top with the key.
+		void pop()
+		{
+			if (!key_value)
+			{
+				require(); // A key not made yet isn't traced.
+			}
+			trace_scope<stack> trace(stack_operation::pop_key, owner,
+				*key_value);
+			require();
+			modify_guard<stack<K, V>, data_type> guard(owner, true);
+			if (guard.split())
+			{
+				refresh();
+			}
+			data->pop_key_top(key_iter, chain_iter);
+			guard.drop_rollback(); // No exceptions. don't revert changes.
+		}
+
+		// Moves the element closest to the top with the key on the top.
+		void touch()
+		{
+			require();
+			modify_guard<stack<K, V>, data_type> guard(owner, true);
+			if (guard.split())
+			{
+				refresh();
+			}
+			auto position = chain_iter->second.end();
+			--position;
+			data->raise(*position, chain_iter, position);
+			guard.drop_rollback(); // No exceptions. don't revert changes.
+		}
+
+		// Returns the first value with the key. It can be modified.
+		V& front()
+		{
+			if (!key_value)
+			{
+				require(); // A key not made yet isn't traced.
+			}
+			trace_scope<stack> trace(stack_operation::front_key, owner,
+				*key_value);
+			require();
+			modify_guard<stack<K, V>, data_type> guard(owner, false);
+			if (guard.split())
+			{
+				refresh();
+			}
+			data->stale_aggregates(chain_iter->second,
+				std::prev(chain_iter->second.end()));
+			V& result = stored_value(key_iter->second.back());
+			guard.drop_rollback(); // No exceptions. don't revert changes.
+			return result;
+		}
+	};
+
+	// An element extracted from a stack, owning its value and nodes,
+	// like the node handles of std::map. Can be inserted into a stack
+	// of the same type.
+	template<typename K, typename V>
+	class stack<K, V>::node_type
+	{
+		typename stack_data<K, V>::extracted_element parts;
+		// Copy of the key, kept while the key still has a node elsewhere.
+		std::optional<K> key_value;
+
+		friend class stack;
+	public:
+		node_type() noexcept = default; // Empty node.
+		node_type(node_type&&) noexcept = default;
+		node_type& operator=(node_type&&) noexcept = default;
+
+		bool empty() const noexcept
+		{
+			return parts.value.empty();
+		}
+
+		explicit operator bool() const noexcept
+		{
+			return !empty();
+		}
+
+		K const& key() const
+		{
+			return parts.key_node ? parts.key_node.key() : *key_value;
+		}
+
+		V& value()
+		{
+			return stored_value(parts.value.front());
+		}
+	};
+
+	template<typename K, typename V>
+	inline typename stack<K, V>::node_type stack<K, V>::extract()
+	{
+		if (data_wrapper->elements.empty())
+		{
+			throw std::invalid_argument("The stack is empty.");
+		}
+		return extract(data_wrapper->elements.back().first->first);
+	}
+
+	template<typename K, typename V>
+	inline typename stack<K, V>::node_type stack<K, V>::extract(K const& key)
+	{
+		auto key_iter = data_wrapper->find_key(key);
+		if (key_iter == data_wrapper->elements_by_key.end())
+		{
+			throw std::invalid_argument
+			("There's no element with the given key in the stack.");
+		}
+		node_type node;
+		if (key_iter->second.size() > 1)
+		{
+			node.key_value.emplace(key);
+		}
+		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, true);
+		if (guard.split())
+		{
+			key_iter = data_wrapper->find_key(key);
+		}
+		data_wrapper->extract_key_top(key_iter,
+			data_wrapper->key_to_list_map.find(key_iter), node.parts);
+		guard.drop_rollback(); // No exceptions. don't revert changes.
+		return node;
+	}
+
+	template<typename K, typename V>
+	inline void stack<K, V>::insert(node_type&& node)
+	{
+		if (node.empty())
+		{
+			return;
+		}
+		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, true);
+		data_wrapper->insert_extracted(node.key(), node.parts);
+		guard.drop_rollback(); // No exceptions. don't revert changes.
+		node = node_type(); // Frees the key nodes if they weren't used.
+	}
+
+	template<typename K, typename V>
+	inline void stack<K, V>::splice_key(stack& other, K const& key)
+	{
+		auto other_key = other.data_wrapper->find_key(key);
+		if (other_key == other.data_wrapper->elements_by_key.end())
+		{
+			throw std::invalid_argument
+			("There's no element with the given key in the stack.");
+		}
+		modify_guard<stack<K, V>, stack_data<K, V>> other_guard(other, true);
+		// For a splice within one stack the second guard sees the
+		// copy made by the first one, and keeps it.
+		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, true);
+		if (other_guard.split())
+		{
+			other_key = other.data_wrapper->find_key(key);
+		}
+		data_wrapper->splice_key(*other.data_wrapper, other_key);
+		other_guard.drop_rollback();
+		guard.drop_rollback(); // No exceptions. don't revert changes.
+	}
+
+	template<typename K, typename V>
+	inline auto stack<K, V>::aggregate(K const& key) const
+		requires stack_aggregate_policy<K, V>::enabled
+	{
+		auto key_iter = data_wrapper->find_key(key);
+		if (key_iter == data_wrapper->elements_by_key.end())
+		{
+			return stack_aggregate_policy<K, V>::identity();
+		}
+		return data_wrapper->key_aggregate(
+			data_wrapper->key_to_list_map.find(key_iter)->second);
+	}
+
+	template<typename K, typename V>
+	inline auto stack<K, V>::aggregate() const
+		requires stack_aggregate_policy<K, V>::enabled
+	{
+		using policy = stack_aggregate_policy<K, V>;
+		auto result = policy::identity();
+		for (auto const& [key_iter, chain] : data_wrapper->key_to_list_map)
+		{
+			result = policy::combine(result,
+				data_wrapper->key_aggregate(chain));
+		}
+		return result;
+	}
+
+	template<typename K, typename V>
+	inline std::pair<K const&, V&> stack<K, V>::front_extreme(bool bIsMax)
+	{
+		trace_scope<stack> trace(stack_operation::front_key, *this);
+		if (data_wrapper->elements.empty())
+		{
+			throw std::invalid_argument("The stack is empty.");
+		}
+		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, false);
+		auto [key_iter, chain_iter] = data_wrapper->extreme_key(bIsMax);
+		data_wrapper->stale_aggregates(chain_iter->second,
+			std::prev(chain_iter->second.end()));
+		std::pair<K const&, V&> result{ key_iter->first,
+			stored_value(key_iter->second.back()) };
+		guard.drop_rollback(); // No exceptions. don't revert changes.
+		return result;
+	}
+
+	template<typename K, typename V>
+	inline std::pair<K const&, V const&> stack<K, V>::front_extreme(
+		bool bIsMax) const
+	{
+		trace_scope<stack> trace(stack_operation::front_key, *this);
+		if (data_wrapper->elements.empty())
+		{
+			throw std::invalid_argument("The stack is empty.");
+		}
+		auto key_iter = data_wrapper->extreme_key(bIsMax).first;
+		return { key_iter->first, storage::get(key_iter->second.back()) };
+	}
+
+	template<typename K, typename V>
+	inline void stack<K, V>::pop_extreme(bool bIsMax)
+	{
+		trace_scope<stack> trace(stack_operation::pop_key, *this);
+		if (data_wrapper->elements.empty())
+		{
+			throw std::invalid_argument("The stack is empty.");
+		}
+		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, true);
+		auto [key_iter, chain_iter] = data_wrapper->extreme_key(bIsMax);
+		data_wrapper->pop_key_top(key_iter, chain_iter);
+		guard.drop_rollback(); // No exceptions. don't revert changes.
+	}
+
+	template<typename K, typename V>
+	inline void stack<K, V>::touch(K const& key)
+	{
+		auto key_iter = data_wrapper->find_key(key);
+		if (key_iter == data_wrapper->elements_by_key.end())
+		{
+			throw std::invalid_argument
+			("There's no element with the given key in the stack.");
+		}
+		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, true);
+		if (guard.split())
+		{
+			key_iter = data_wrapper->find_key(key);
+		}
+		auto chain_iter = data_wrapper->key_to_list_map.find(key_iter);
+		auto position = chain_iter->second.end();
+		--position;
+		data_wrapper->raise(*position, chain_iter, position);
+		guard.drop_rollback(); // No exceptions. don't revert changes.
+	}
+
+	template<typename K, typename V>
+	inline void stack<K, V>::touch(element_handle handle)
+	{
+		auto tracked_iter = data_wrapper->tracked.find(handle.serial);
+		if (tracked_iter == data_wrapper->tracked.end())
+		{
+			throw std::invalid_argument
+			("There's no element with the given handle in the stack.");
+		}
+		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, true);
+		if (guard.split())
+		{
+			tracked_iter = data_wrapper->tracked.find(handle.serial);
+		}
+		auto& where = tracked_iter->second;
+		data_wrapper->raise(where.element, where.chain, where.position);
+		guard.drop_rollback(); // No exceptions. don't revert changes.
+	}
+
+	template<typename K, typename V>
+	inline void stack<K, V>::append(stack&& other)
+	{
+		if (this == &other)
 		{
-			if (rollback)
-			{
-				stack.bIsShareable = bIsShareable;
-				stack.data_wrapper = data;
-			}
+			throw std::invalid_argument("A stack can't be appended to itself.");
+		}
+		if (other.data_wrapper->elements.empty())
+		{
+			return;
+		}
+		if (data_wrapper.use_count() == 0)
+		{
+			*this = move(other); // Nothing here yet, take the data.
+			return;
 		}
+		modify_guard<stack<K, V>, stack_data<K, V>> other_guard(other, true);
+		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, true);
+		auto& tracked = data_wrapper->tracked;
+		tracked.reserve(tracked.size() + other.data_wrapper->tracked.size());
+		data_wrapper->append(*other.data_wrapper);
+		other_guard.drop_rollback();
+		guard.drop_rollback(); // No exceptions. don't revert changes.
+	}
 
-		// Marks the fact that we don't want to revert changes.
-		void drop_rollback()
+	template<typename K, typename V>
+	inline stack<K, V> stack<K, V>::split_at(size_t depth)
+	{
+		if (depth > data_wrapper->elements.size())
 		{
-			rollback = false;
+			throw std::invalid_argument
+			("The stack has fewer elements than the given depth.");
 		}
-	};
+		stack result;
+		if (depth == 0)
+		{
+			return result;
+		}
+		if (depth == data_wrapper->elements.size())
+		{
+			// The whole data goes, shared or not.
+			result.data_wrapper = std::exchange(data_wrapper,
+				data_wrapper->make_empty());
+			result.bIsShareable = std::exchange(bIsShareable, true);
+			return result;
+		}
+		result.data_wrapper = data_wrapper->make_fresh();
+		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, true);
+		data_wrapper->split_top(depth, *result.data_wrapper);
+		guard.drop_rollback(); // No exceptions. don't revert changes.
+		return result;
+	}
+
+	template<typename K, typename V>
+	inline typename stack<K, V>::key_handle_type
+		stack<K, V>::key_handle(K const& key)
+	{
+		return key_handle_type(*this, key);
+	}
+
+	template<typename K, typename V>
+	inline typename stack<K, V>::key_handle_type
+		stack<K, V>::key_handle(lookup_key_type const& key)
+		requires key_lookup_traits<K>::enabled
+	{
+		return key_handle_type(*this, key);
+	}
 
 	template<typename K, typename V>
 	inline void stack<K, V>::push(K const& key, V const& value)
 	{
+		trace_scope<stack> trace(stack_operation::push, *this, key);
 		// Add key : value entry to the elements_by_key map.
 		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, true);
+		auto found = data_wrapper->find_key(key);
+		bool bIsNewKey = found == data_wrapper->elements_by_key.end();
 		map_access_guard elements_by_key(
 			data_wrapper->elements_by_key,
-			key
+			key,
+			found
 		);
 		push_back_guard push_value(
 			elements_by_key(),
-			value
+			stack_data<K, V>::storage::make(value)
 		);
 
 		// Add key_iter : value_iter pair to the elements_list.
@@ -371,7 +3806,8 @@ namespace cxx
 		--value_iter;
 		push_back_guard push_element(
 			data_wrapper->elements,
-			pair{ elements_by_key.iter(), value_iter }
+			typename stack_data<K, V>::element_entry{
+				elements_by_key.iter(), value_iter }
 		);
 		
 		// Add map_iter : value_iter entry to the key_to_list map.
@@ -385,6 +3821,9 @@ namespace cxx
 			key_to_list_map(),
 			list_iter
 		);
+		auto position = key_to_list_map().end();
+		--position;
+		data_wrapper->settle_aggregates(key_to_list_map.iter(), position);
 		// If none of the above threw any exception, here we are calling
 		// drop_rollback() functions so that changes on data structures
 		// won't be reverted.
@@ -394,81 +3833,160 @@ namespace cxx
 		push_element.drop_rollback();
 		key_to_list_map.drop_rollback();
 		push_list.drop_rollback();
+		if (bIsNewKey)
+		{
+			data_wrapper->index_key(elements_by_key.iter());
+		}
 	}
 
 	template<typename K, typename V>
-	inline void stack<K, V>::pop() {
-		if (data_wrapper->elements.empty())
+	inline element_handle stack<K, V>::push_with_handle(K const& key,
+		V const& value)
+	{
+		uint64_t serial = stack_data<K, V>::next_serial();
+		push(key, value);
+		// The push left the data unshared, so only tracking can fail.
+		try
 		{
-			throw std::invalid_argument("The stack is empty.");
+			data_wrapper->track_top(serial);
 		}
-		// Find iterators to elements that we want to remove from the stack.
-		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, true);
-		auto elements_last_item = data_wrapper->elements.back();
-		auto map_iter = elements_last_item.first;
-		auto value_iter = elements_last_item.second;
-		K key = map_iter->first;
-		auto pop_iter = data_wrapper->key_to_list_map[map_iter].end();
-		--pop_iter;
-		data_wrapper->key_to_list_map[map_iter].erase(pop_iter);
-		// If there is nothing under the key, we can erase it.
-		if (data_wrapper->key_to_list_map[map_iter].empty())
+		catch (...)
 		{
-			data_wrapper->key_to_list_map.erase(map_iter);
+			auto key_iter = data_wrapper->elements.back().first;
+			data_wrapper->pop_key_top(key_iter,
+				data_wrapper->key_to_list_map.find(key_iter));
+			throw;
 		}
+		return element_handle(serial);
+	}
 
-		data_wrapper->elements_by_key[key].erase(value_iter);
-		// If there is nothing under the key, we can erase it.
-		if (data_wrapper->elements_by_key[key].empty())
+	template<typename K, typename V>
+	inline void stack<K, V>::erase(element_handle handle)
+	{
+		auto tracked_iter = data_wrapper->tracked.find(handle.serial);
+		if (tracked_iter == data_wrapper->tracked.end())
+		{
+			throw std::invalid_argument
+			("There's no element with the given handle in the stack.");
+		}
+		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, true);
+		if (guard.split())
 		{
-			data_wrapper->elements_by_key.erase(key);
+			tracked_iter = data_wrapper->tracked.find(handle.serial);
 		}
+		data_wrapper->erase_tracked(tracked_iter);
+		guard.drop_rollback(); // No exceptions. don't revert changes.
+	}
+
+	template<typename K, typename V>
+	inline bool stack<K, V>::contains(element_handle handle) const noexcept
+	{
+		return data_wrapper->tracked.contains(handle.serial);
+	}
 
-		data_wrapper->elements.pop_back();
+	template<typename K, typename V>
+	inline void stack<K, V>::pop() {
+		trace_scope<stack> trace(stack_operation::pop, *this);
+		if (data_wrapper->elements.empty())
+		{
+			throw std::invalid_argument("The stack is empty.");
+		}
+		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, true);
+		// The top of the stack is also the top of its key.
+		auto map_iter = data_wrapper->elements.back().first;
+		data_wrapper->pop_key_top(map_iter,
+			data_wrapper->key_to_list_map.find(map_iter));
 		guard.drop_rollback(); // No exceptions. don't revert changes.
 	}
 
 	template<typename K, typename V>
 	inline void stack<K, V>::pop(K const& key) {
-		if (data_wrapper->elements_by_key[key].empty())
+		trace_scope<stack> trace(stack_operation::pop_key, *this, key);
+		auto map_iter = data_wrapper->find_key(key);
+		if (map_iter == data_wrapper->elements_by_key.end())
 		{
 			throw std::invalid_argument
 			("There's no element with the given key in the stack.");
 		}
-		// Find iterators to elements that we want to remove from the stack.
 		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, true);
-		auto map_iter = data_wrapper->elements_by_key.find(key);
-		auto pop_iter = data_wrapper->key_to_list_map[map_iter].back();
-		data_wrapper->elements.erase(pop_iter);
+		if (guard.split())
+		{
+			map_iter = data_wrapper->find_key(key);
+		}
+		data_wrapper->pop_key_top(map_iter,
+			data_wrapper->key_to_list_map.find(map_iter));
+		guard.drop_rollback(); // No exceptions. don't revert changes.
+	}
 
-		auto key_to_list_end = data_wrapper->key_to_list_map[map_iter].end();
-		--key_to_list_end;
-		data_wrapper->key_to_list_map[map_iter].erase(key_to_list_end);
-		// If there is nothing under the key, we can erase it.
-		if (data_wrapper->key_to_list_map[map_iter].empty())
+	template<typename K, typename V>
+	inline void stack<K, V>::clear()
+	{
+		using policy = stack_reclaim_policy<K, V>;
+		bool bIsReclaimed = policy::enabled &&
+			data_wrapper->elements.size() >= policy::min_elements;
+		if (data_wrapper.use_count() != 1 || bIsReclaimed)
+		{
+			// Others still use the data, or the reclaimer frees it.
+			// Start with a fresh one.
+			release(std::exchange(data_wrapper, data_wrapper->make_empty()));
+		}
+		else
 		{
-			data_wrapper->key_to_list_map.erase(map_iter);
+			data_wrapper->clear();
 		}
+		bIsShareable = true;
+	}
 
-		auto by_key_end = data_wrapper->elements_by_key[key].end();
-		--by_key_end;
-		data_wrapper->elements_by_key[key].erase(by_key_end);
-		// If there is nothing under the key, we can erase it.
-		if (data_wrapper->elements_by_key[key].empty())
+	template<typename K, typename V>
+	inline void stack<K, V>::clear_retain()
+	{
+		if (data_wrapper.use_count() == 1)
 		{
-			data_wrapper->elements_by_key.erase(key);
+			// Cleared in place, the nodes must be freed by this thread.
+			data_wrapper->retain_nodes();
+			data_wrapper->clear();
+			bIsShareable = true;
+			return;
 		}
+		clear();
+	}
+
+	template<typename K, typename V>
+	inline void stack<K, V>::reserve(size_t elements, size_t keys)
+	{
+		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, true);
+		data_wrapper->reserve(elements, keys);
 		guard.drop_rollback(); // No exceptions. don't revert changes.
 	}
 
 	template<typename K, typename V>
-	inline void stack<K, V>::clear()
+	inline void stack<K, V>::compact()
+	{
+		// Cached nodes are scattered, so the capacity set aside for this
+		// data is given back and the copy takes its nodes from the heap.
+		// The copy constructor inserts the elements in stack order, and
+		// boxed values are cloned, so they get fresh storage too.
+		if (data_wrapper.use_count() == 1)
+		{
+			data_wrapper->release_reservation();
+		}
+		if (data_wrapper->elements.empty())
+		{
+			release(std::exchange(data_wrapper, data_wrapper->make_empty()));
+		}
+		else
+		{
+			release(std::exchange(data_wrapper,
+				make_node_shared<stack_data<K, V>>(*data_wrapper, true)));
+		}
+		bIsShareable = true;
+	}
+
+	template<typename K, typename V>
+	inline void stack<K, V>::enable_key_filter(size_t expected_keys)
 	{
-		// Clear all the data.
 		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, true);
-		data_wrapper->elements.clear();
-		data_wrapper->elements_by_key.clear();
-		data_wrapper->key_to_list_map.clear();
+		data_wrapper->enable_filter(expected_keys);
 		guard.drop_rollback(); // No exceptions. don't revert changes.
 	}
 
@@ -480,24 +3998,88 @@ namespace cxx
 
 	template<typename K, typename V>
 	inline size_t stack<K, V>::count(K const& key) const noexcept {
-		if (!data_wrapper->elements_by_key.contains(key))
+		auto key_iter = data_wrapper->find_key(key);
+		if (key_iter == data_wrapper->elements_by_key.end())
 		{
 			return 0; // There are no values with the given key.
 		}
-		return data_wrapper->elements_by_key[key].size();
+		return key_iter->second.size();
+	}
+
+	template<typename K, typename V>
+	inline std::vector<std::pair<K, size_t>> stack<K, V>::counts() const
+	{
+		std::vector<std::pair<K, size_t>> result;
+		result.reserve(data_wrapper->elements_by_key.size());
+		for (auto const& [key, values] : data_wrapper->elements_by_key)
+		{
+			result.emplace_back(key, values.size());
+		}
+		return result;
+	}
+
+	template<typename K, typename V>
+	inline std::vector<size_t> stack<K, V>::count_many(
+		std::span<const K> keys) const
+	{
+		auto& by_key = data_wrapper->elements_by_key;
+		std::vector<size_t> result(keys.size(), 0);
+		// Few queries, or keys found with a vector compare anyway:
+		// look every key up on its own.
+		if (data_wrapper->has_flat_keys() ||
+			keys.size() * std::bit_width(by_key.size()) < by_key.size())
+		{
+			for (size_t i = 0; i < keys.size(); ++i)
+			{
+				auto key_iter = data_wrapper->find_key(keys[i]);
+				if (key_iter != by_key.end())
+				{
+					result[i] = key_iter->second.size();
+				}
+			}
+			return result;
+		}
+
+		// Otherwise sort the queries and walk the key tree once.
+		std::vector<size_t> order(keys.size());
+		std::iota(order.begin(), order.end(), size_t{ 0 });
+		std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+			{ return keys[a] < keys[b]; });
+		auto key_iter = by_key.begin();
+		for (size_t i : order)
+		{
+			while (key_iter != by_key.end() && key_iter->first < keys[i])
+			{
+				++key_iter;
+			}
+			if (key_iter == by_key.end())
+			{
+				break;
+			}
+			if (!(keys[i] < key_iter->first))
+			{
+				result[i] = key_iter->second.size();
+			}
+		}
+		return result;
 	}
 
 	template<typename K, typename V>
 	inline std::pair<K const&, V&> stack<K, V>::front()
 	{
+		trace_scope<stack> trace(stack_operation::front, *this);
 		if (data_wrapper->elements.size() == 0)
 		{
 			throw std::invalid_argument("The stack is empty.");
 		}
 		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, false);
+		if constexpr (stack_aggregate_policy<K, V>::enabled)
+		{
+			data_wrapper->elements.back().slot.bIsStale = true;
+		}
 		const K& key = data_wrapper->elements.back().first->first;
 		std::pair<K const&, V&> result{ key,
-			*(data_wrapper->elements.back().second) };
+			stored_value(*(data_wrapper->elements.back().second)) };
 		guard.drop_rollback(); // No exceptions. don't revert changes.
 		return result;
 	}
@@ -505,13 +4087,14 @@ namespace cxx
 	template<typename K, typename V>
 	inline std::pair<K const&, V const&> stack<K, V>::front() const
 	{
+		trace_scope<stack> trace(stack_operation::front, *this);
 		if (data_wrapper->elements.size() == 0)
 		{
 			throw std::invalid_argument("The stack is empty.");
 		}
 		const K& key = data_wrapper->elements.back().first->first;
 		std::pair<K const&, V const&> result{ key,
-			*(data_wrapper->elements.back().second) };
+			storage::get(*(data_wrapper->elements.back().second)) };
 
 		return result;
 	}
@@ -519,44 +4102,345 @@ namespace cxx
 	template<typename K, typename V>
 	inline V& stack<K, V>::front(K const& key)
 	{
-		if (data_wrapper->elements_by_key[key].empty())
+		trace_scope<stack> trace(stack_operation::front_key, *this, key);
+		auto key_iter = data_wrapper->find_key(key);
+		if (key_iter == data_wrapper->elements_by_key.end())
 		{
 			throw std::invalid_argument
 			("There's no element with the given key in the stack.");
 		}
 		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, false);
+		if (guard.split())
+		{
+			key_iter = data_wrapper->find_key(key);
+		}
+		data_wrapper->stale_aggregates(key_iter, false);
+		V& result = stored_value(key_iter->second.back());
 		guard.drop_rollback(); // No exceptions. don't revert changes.
-		return data_wrapper->elements_by_key[key].back();
+		return result;
 	}
 
 	template<typename K, typename V>
 	inline V const& stack<K, V>::front(K const& key) const
 	{
-		if (data_wrapper->elements_by_key[key].empty())
+		trace_scope<stack> trace(stack_operation::front_key, *this, key);
+		auto key_iter = data_wrapper->find_key(key);
+		if (key_iter == data_wrapper->elements_by_key.end())
+		{
+			throw std::invalid_argument
+			("There's no element with the given key in the stack.");
+		}
+
+		return storage::get(key_iter->second.back());
+	}
+
+	template<typename K, typename V>
+	inline std::ranges::subrange<typename stack<K, V>::const_value_iterator>
+		stack<K, V>::values(K const& key) const
+	{
+		auto key_iter = data_wrapper->find_key(key);
+		if (key_iter == data_wrapper->elements_by_key.end())
+		{
+			return {}; // There are no values with the given key.
+		}
+		return { const_value_iterator(key_iter->second.cbegin()),
+			const_value_iterator(key_iter->second.cend()) };
+	}
+
+	template<typename K, typename V>
+	inline std::ranges::subrange<typename stack<K, V>::value_iterator>
+		stack<K, V>::values(K const& key)
+	{
+		auto key_iter = data_wrapper->find_key(key);
+		if (key_iter == data_wrapper->elements_by_key.end())
+		{
+			return {}; // There are no values with the given key.
+		}
+		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, false);
+		if (guard.split())
+		{
+			key_iter = data_wrapper->find_key(key);
+		}
+		data_wrapper->stale_aggregates(key_iter, true);
+		guard.drop_rollback(); // No exceptions. don't revert changes.
+		return { value_iterator(key_iter->second.begin()),
+			value_iterator(key_iter->second.end()) };
+	}
+
+	template<typename K, typename V>
+	inline void stack<K, V>::pop(lookup_key_type const& key)
+		requires key_lookup_traits<K>::enabled
+	{
+		auto found = key_lookup_traits<K>::find(key);
+		if (!found)
+		{
+			throw std::invalid_argument
+			("There's no element with the given key in the stack.");
+		}
+		pop(*found);
+	}
+
+	template<typename K, typename V>
+	inline size_t stack<K, V>::count(lookup_key_type const& key) const
+		requires key_lookup_traits<K>::enabled
+	{
+		auto found = key_lookup_traits<K>::find(key);
+		return found ? count(*found) : 0;
+	}
+
+	template<typename K, typename V>
+	inline V& stack<K, V>::front(lookup_key_type const& key)
+		requires key_lookup_traits<K>::enabled
+	{
+		auto found = key_lookup_traits<K>::find(key);
+		if (!found)
+		{
+			throw std::invalid_argument
+			("There's no element with the given key in the stack.");
+		}
+		return front(*found);
+	}
+
+	template<typename K, typename V>
+	inline V const& stack<K, V>::front(lookup_key_type const& key) const
+		requires key_lookup_traits<K>::enabled
+	{
+		auto found = key_lookup_traits<K>::find(key);
+		if (!found)
 		{
 			throw std::invalid_argument
 			("There's no element with the given key in the stack.");
 		}
+		return front(*found);
+	}
+
+	template<typename K, typename V>
+	inline std::ranges::subrange<typename stack<K, V>::const_value_iterator>
+		stack<K, V>::values(lookup_key_type const& key) const
+		requires key_lookup_traits<K>::enabled
+	{
+		auto found = key_lookup_traits<K>::find(key);
+		if (!found)
+		{
+			return {}; // Never interned, so no stack has it.
+		}
+		return values(*found);
+	}
+
+	template<typename K, typename V>
+	inline std::ranges::subrange<typename stack<K, V>::value_iterator>
+		stack<K, V>::values(lookup_key_type const& key)
+		requires key_lookup_traits<K>::enabled
+	{
+		auto found = key_lookup_traits<K>::find(key);
+		if (!found)
+		{
+			return {}; // Never interned, so no stack has it.
+		}
+		return values(*found);
+	}
+
+	template<typename K, typename V>
+	inline std::ranges::subrange<typename stack<K, V>::const_element_iterator>
+		stack<K, V>::elements() const
+	{
+		return { const_element_iterator(data_wrapper->elements.cbegin()),
+			const_element_iterator(data_wrapper->elements.cend()) };
+	}
+
+	template<typename K, typename V>
+	inline std::ranges::subrange<typename stack<K, V>::element_iterator>
+		stack<K, V>::elements()
+	{
+		modify_guard<stack<K, V>, stack_data<K, V>> guard(*this, false);
+		if constexpr (stack_aggregate_policy<K, V>::enabled)
+		{
+			for (auto& entry : data_wrapper->elements)
+			{
+				entry.slot.bIsStale = true;
+			}
+		}
+		guard.drop_rollback(); // No exceptions. don't revert changes.
+		return { element_iterator(data_wrapper->elements.begin()),
+			element_iterator(data_wrapper->elements.end()) };
+	}
+
+	template<typename K, typename V>
+	template <typename Task>
+	inline size_t stack<K, V>::run_partitioned(bool bIsParallel,
+		size_t parts_limit, Task task) const
+	{
+		auto const& by_key = data_wrapper->elements_by_key;
+		size_t threads = std::max(1u, std::thread::hardware_concurrency());
+		size_t parts = std::min({ parts_limit, threads,
+			std::max<size_t>(1, size() / parallel_grain) });
+		if (!bIsParallel || parts <= 1)
+		{
+			task(size_t{ 0 }, by_key.cbegin(), by_key.cend());
+			return 1;
+		}
+
+		// Cut the key index into ranges of about size() / parts elements.
+		std::vector<typename stack_data<K, V>::element_map::const_iterator>
+			bounds{ by_key.cbegin() };
+		size_t share = size() / parts;
+		size_t taken = 0;
+		for (auto iter = by_key.cbegin(); iter != by_key.cend(); ++iter)
+		{
+			taken += iter->second.size();
+			if (taken >= share && bounds.size() < parts)
+			{
+				bounds.push_back(std::next(iter));
+				taken = 0;
+			}
+		}
+		if (bounds.back() != by_key.cend())
+		{
+			bounds.push_back(by_key.cend());
+		}
+
+		// The calling thread takes the first range itself.
+		std::vector<std::exception_ptr> errors(bounds.size() - 1);
+		std::vector<std::jthread> workers;
+		workers.reserve(bounds.size() - 2);
+		for (size_t part = 1; part + 1 < bounds.size(); ++part)
+		{
+			workers.emplace_back([&, part]
+				{
+					try
+					{
+						task(part, bounds[part], bounds[part + 1]);
+					}
+					catch (...)
+					{
+						errors[part] = std::current_exception();
+					}
+				});
+		}
+		try
+		{
+			task(size_t{ 0 }, bounds[0], bounds[1]);
+		}
+		catch (...)
+		{
+			errors[0] = std::current_exception();
+		}
+		workers.clear(); // Joins the threads.
+		for (auto& error : errors)
+		{
+			if (error)
+			{
+				std::rethrow_exception(error);
+			}
+		}
+		return bounds.size() - 1;
+	}
+
+	template<typename K, typename V>
+	template <typename ExecutionPolicy, typename Function>
+		requires execution_policy<std::remove_cvref_t<ExecutionPolicy>>
+	inline void stack<K, V>::for_each(ExecutionPolicy&&, Function fn) const
+	{
+		run_partitioned(is_parallel_policy<ExecutionPolicy>(), SIZE_MAX,
+			[&fn](size_t, auto first, auto last)
+			{
+				for (; first != last; ++first)
+				{
+					for (auto const& stored : first->second)
+					{
+						V const& value = storage::get(stored);
+						fn(first->first, value);
+					}
+				}
+			});
+	}
 
-		return data_wrapper->elements_by_key[key].back();
+	template<typename K, typename V>
+	template <typename ExecutionPolicy, typename T,
+		typename Reduce, typename Transform>
+		requires execution_policy<std::remove_cvref_t<ExecutionPolicy>>
+	inline T stack<K, V>::transform_reduce(ExecutionPolicy&&, T init,
+		Reduce reduce, Transform transform) const
+	{
+		size_t threads = std::max(1u, std::thread::hardware_concurrency());
+		std::vector<std::optional<T>> partials(threads);
+		size_t parts = run_partitioned(is_parallel_policy<ExecutionPolicy>(),
+			threads, [&](size_t part, auto first, auto last)
+			{
+				std::optional<T>& partial = partials[part];
+				for (; first != last; ++first)
+				{
+					for (auto const& stored : first->second)
+					{
+						V const& value = storage::get(stored);
+						if (partial)
+						{
+							partial = reduce(move(*partial),
+								transform(first->first, value));
+						}
+						else
+						{
+							partial.emplace(transform(first->first, value));
+						}
+					}
+				}
+			});
+		for (size_t part = 0; part < parts; ++part)
+		{
+			if (partials[part])
+			{
+				init = reduce(move(init), move(*partials[part]));
+			}
+		}
+		return init;
 	}
 
 	template<typename K, typename V>
-	inline stack<K, V>& stack<K, V>::operator=(stack other)
+	inline stack<K, V>& stack<K, V>::operator=(stack const& other)
 	{
+		trace_scope<stack> trace(stack_operation::assign, other);
 		if (this == &other) { return *this; } // check for self-assignment.
 		if (other.bIsShareable)
 		{
-			data_wrapper = other.data_wrapper;
+			release(std::exchange(data_wrapper, other.data_wrapper));
 		}
 		else
 		{
 			// Create new stack_data object for this stack.
-			data_wrapper = make_shared<stack_data<K, V>>(*other.data_wrapper);
+			release(std::exchange(data_wrapper,
+				make_node_shared<stack_data<K, V>>(*other.data_wrapper, true)));
 		}
+		// References to the old data don't reach the new one.
+		bIsShareable = true;
+
+		return *this;
+	}
 
+	template<typename K, typename V>
+	inline stack<K, V>& stack<K, V>::operator=(stack&& other) noexcept
+	{
+		// Safe for self-assignment, the old data is put back.
+		release(std::exchange(data_wrapper, std::exchange(other.data_wrapper,
+			stack_data<K, V>::empty())));
+		bIsShareable = std::exchange(other.bIsShareable, true);
 		return *this;
 	}
+
+	template<typename K, typename V>
+	inline void stack<K, V>::swap(stack& other) noexcept
+	{
+		data_wrapper.swap(other.data_wrapper);
+		std::swap(bIsShareable, other.bIsShareable);
+	}
 }
 
+template <typename K>
+struct std::hash<cxx::interned_key<K>>
+{
+	size_t operator()(cxx::interned_key<K> const& key) const noexcept
+	{
+		return key.id();
+	}
+};
+
 #endif
@@ -1,7 +1,12 @@
+#define CXX_STACK_ALLOCATION_STATS
 #include "stack.h"
 #include <cassert>
 #include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -11,6 +16,43 @@ using std::pair;
 using std::vector;
 using cxx::stack;
 
+// Metryki sa wlaczane tylko dla wybranych typow stosu.
+template <>
+struct cxx::stack_trace_policy<int, short> : cxx::metrics_trace_policy {};
+
+// Suma wartosci kazdego klucza, utrzymywana przez stos<int, long long>.
+template <>
+struct cxx::stack_aggregate_policy<int, long long> {
+    static constexpr bool enabled = true;
+    using type = long long;
+    static long long identity() { return 0; }
+    static long long lift(long long value) { return value; }
+    // Liczba wywolan, zeby sprawdzic, ze sumy nie sa liczone od nowa.
+    static inline int combined = 0;
+    static long long combine(long long a, long long b) {
+        ++combined;
+        return a + b;
+    }
+};
+
+// Wartosc liczaca, ile razy zostala zniszczona poza watkiem main.
+std::thread::id const main_thread = std::this_thread::get_id();
+std::atomic<int> reclaimed_values{ 0 };
+struct reclaimed {
+    int value;
+    ~reclaimed() {
+        if (std::this_thread::get_id() != main_thread)
+            reclaimed_values.fetch_add(1);
+    }
+};
+
+// Duze stosy<int, reclaimed> sa zwalniane przez watek w tle.
+template <>
+struct cxx::stack_reclaim_policy<int, reclaimed> {
+    static constexpr bool enabled = true;
+    static constexpr size_t min_elements = 100;
+};
+
 int main() {
     stack<int, int> stack1;
     stack1.push(3, 10);
@@ -96,4 +138,845 @@ int main() {
         stack1.push(i, i);
     for (int i = 0; i < 1000000; i++)
         vec.push_back(stack1);  // Wszystkie obiekty w vec wspĂłĹdzielÄ dane.
+
+    // Budzet alokacji kolejnych operacji. Zmierzone wartosci sa wypisywane,
+    // a przekroczenie budzetu konczy program.
+    {
+        auto report = [](char const* operation,
+                         cxx::allocation_probe const& probe) {
+            cxx::allocation_stats spent = probe.measured();
+            std::printf("%-22s %4llu nodes %4llu allocs %6llu bytes\n",
+                        operation,
+                        static_cast<unsigned long long>(spent.node_requests),
+                        static_cast<unsigned long long>(spent.heap_allocations),
+                        static_cast<unsigned long long>(spent.heap_bytes));
+            return spent;
+        };
+
+        stack<int, int> budget;
+        budget.push(1, 1);
+        cxx::allocation_probe push_new;
+        budget.push(2, 2);
+        assert(report("push (new key)", push_new).node_requests <= 5);
+        cxx::allocation_probe push_existing;
+        budget.push(2, 3);
+        assert(report("push (existing key)", push_existing).node_requests <= 3);
+        cxx::allocation_probe pop_key;
+        budget.pop(1);
+        assert(report("pop(key)", pop_key).heap_allocations == 0);
+        cxx::allocation_probe pop_copy;
+        budget.pop();
+        stack<int, int> copy = budget;
+        stack<int, int> empty;
+        empty.clear();
+        assert(report("pop, copy, clear", pop_copy).heap_allocations == 0);
+
+        // Pierwsza modyfikacja kopii kopiuje dane: najwyzej trzy wezly na
+        // element, dwa na klucz i jeden na same dane, plus wezly pusha.
+        for (int i = 0; i < 20; ++i)
+            budget.push(i % 4, i);
+        copy = budget;
+        size_t elements = copy.size();
+        size_t keys = 4;
+        cxx::allocation_probe unshare;
+        copy.push(5, 5);
+        cxx::allocation_stats spent = report("unshare + push", unshare);
+        assert(spent.node_requests <= 3 * elements + 2 * keys + 1 + 5);
+        assert(spent.heap_allocations <= spent.node_requests);
+        assert(budget.size() == elements && copy.size() == elements + 1);
+        assert(budget.count(5) == 0 && copy.count(5) == 1);
+    }
+
+    // Wezly zarezerwowane dla stosu wracaja na sterte razem z nim.
+    {
+        cxx::allocation_probe probe;
+        {
+            stack<int, int> reserved(100000, 10);
+        }
+        cxx::allocation_stats spent = probe.measured();
+        assert(spent.heap_allocations == spent.heap_frees);
+    }
+
+    // Rezerwacja stosu zniszczonego w innym watku tez wraca: watek, ktory
+    // ja zrobil, oddaje wezly przy nastepnym uzyciu pamieci podrecznej.
+    {
+        for (int round = 0; round < 5; ++round) {
+            stack<int, int> handed_off(10000, 10);
+            handed_off.push(1, round);
+            std::thread([s = std::move(handed_off)]() mutable {
+                assert(s.size() == 1);
+            }).join();
+        }
+        cxx::allocation_probe probe;
+        {
+            stack<int, int> unrelated;
+            for (int i = 0; i < 30000; ++i)
+                unrelated.push(i % 100, i);
+        }
+        cxx::allocation_stats spent = probe.measured();
+        assert(spent.heap_frees == spent.node_requests);
+    }
+
+    // clear_retain(): ponowne wypelnienie stosu nie alokuje, a wezly
+    // zatrzymane w pamieci podrecznej wracaja, gdy stos zginie, takze
+    // w innym watku.
+    {
+        stack<int, int> refilled;
+        for (int i = 0; i < 1000; ++i)
+            refilled.push(i % 10, i);
+        refilled.clear_retain();
+        assert(refilled.size() == 0 && refilled.count(3) == 0);
+        cxx::allocation_probe refill;
+        for (int i = 0; i < 1000; ++i)
+            refilled.push(i % 10, i);
+        assert(refill.within_budget(0));
+        assert(refilled.size() == 1000 && refilled.count(3) == 100);
+        refilled.clear_retain();
+        refilled.push(1, 1);
+        std::thread([s = std::move(refilled)]() mutable {
+            assert(s.size() == 1);
+        }).join();
+
+        cxx::allocation_probe probe;
+        {
+            stack<int, int> unrelated;
+            for (int i = 0; i < 3000; ++i)
+                unrelated.push(i % 10, i);
+        }
+        cxx::allocation_stats spent = probe.measured();
+        assert(spent.heap_frees == spent.node_requests);
+    }
+
+    // Indeks plaski kluczy: liczba kluczy przekracza flat_key_capacity (32),
+    // a potem spada ponizej polowy; wyszukiwanie musi zgadzac sie z modelem.
+    {
+        stack<int, int> flat;
+        vector<size_t> expected(41, 0);
+        for (int key = 0; key <= 40; ++key) {
+            for (int j = 0; j <= key % 3; ++j) {
+                flat.push(key, key * 10 + j);
+                ++expected[key];
+            }
+            for (int probe = 0; probe <= 40; ++probe)
+                assert(flat.count(probe) == expected[probe]);
+        }
+        size_t total = 0;
+        for (size_t n : expected)
+            total += n;
+        assert(flat.size() == total);
+        for (int key = 40; key >= 15; --key) {
+            assert(flat.front(key) == key * 10 + key % 3);
+            flat.pop(key);
+            --expected[key];
+            while (expected[key] > 0) {
+                flat.pop(key);
+                --expected[key];
+            }
+            for (int probe = 0; probe <= 41; ++probe)
+                assert(flat.count(probe) == (probe <= 40 ? expected[probe] : 0));
+        }
+        for (int key = 0; key < 15; ++key)
+            assert(flat.count(key) == static_cast<size_t>(key % 3 + 1));
+        flat.pop();
+        assert(flat.count(14) == 2);
+        flat.push(40, 1);
+        assert(flat.count(40) == 1 && flat.front(40) == 1);
+    }
+    // Filtr kluczy: liczniki dla kluczy obecnych, usunietych i nigdy
+    // niewstawionych po kopii, po clear i po pop(key).
+    {
+        stack<int, int> filtered;
+        filtered.enable_key_filter(256);
+        for (int key = 0; key < 200; ++key)
+            filtered.push(key * 2, key);
+        filtered.push(10, 1000);
+        for (int key = 0; key < 100; ++key)
+            filtered.pop(key * 4);
+        auto check = [](stack<int, int> const& s, size_t twice10) {
+            for (int key = 0; key < 400; ++key) {
+                size_t expected = 0;
+                if (key % 2 == 0 && key % 4 != 0)
+                    expected = key == 10 ? twice10 : 1;
+                assert(s.count(key) == expected);
+            }
+            assert(s.count(-1) == 0 && s.count(1000) == 0);
+        };
+        check(filtered, 2);
+
+        stack<int, int> filtered_copy = filtered;
+        check(filtered_copy, 2);
+        filtered_copy.pop(10);
+        check(filtered_copy, 1);
+        check(filtered, 2);
+        filtered_copy.pop(10);
+        assert(filtered_copy.count(10) == 0);
+        filtered_copy.push(4, 4);
+        assert(filtered_copy.count(4) == 1 && filtered.count(4) == 0);
+
+        filtered.clear();
+        for (int key = -1; key < 400; ++key)
+            assert(filtered.count(key) == 0);
+        filtered.push(8, 8);
+        assert(filtered.count(8) == 1 && filtered.count(6) == 0);
+        assert(filtered_copy.count(6) == 1 && filtered_copy.count(8) == 0);
+
+        // Wierzch oddzielony przez split_at zachowuje filtr z kluczami.
+        for (int key = 0; key < 100; ++key)
+            filtered.push(key * 3, key);
+        stack<int, int> split_top = filtered.split_at(60);
+        for (int key = 0; key < 300; ++key) {
+            size_t low = key % 3 == 0 && key / 3 < 40 ? 1 : 0;
+            size_t high = key % 3 == 0 && key / 3 >= 40 ? 1 : 0;
+            assert(filtered.count(key) == low + (key == 8 ? 1 : 0));
+            assert(split_top.count(key) == high);
+        }
+        split_top.push(1000, 1);
+        assert(split_top.count(1000) == 1 && split_top.count(1001) == 0);
+    }
+    // Klucze z dwoch roznych slownikow nigdy nie sa sobie rowne.
+    {
+        using key = cxx::interned_key<std::string>;
+        cxx::key_dictionary<std::string> d1, d2;
+        stack<key, int> interned;
+        key alpha = d1.intern("alpha");
+        key beta = d2.intern("beta");
+        assert(alpha != beta && (alpha <=> beta) != 0);
+        // Identyfikatory sa 64-bitowe, wiec licznik sie nie przekreci.
+        static_assert(sizeof(alpha.id()) == 8);
+        assert(beta.id() > alpha.id());
+        assert(std::hash<key>{}(alpha) != std::hash<key>{}(beta));
+        interned.push(alpha, 1);
+        interned.push(beta, 2);
+        assert(interned.size() == 2);
+        assert(interned.count(alpha) == 1 && interned.count(beta) == 1);
+        assert(interned.front(beta) == 2);
+        assert(*d1.find("alpha") == alpha && !d1.find("beta"));
+    }
+    // Szukanie po zwyklym kluczu nie dopisuje go do globalnego slownika.
+    {
+        using key = cxx::interned_key<std::string>;
+        auto& dictionary = cxx::key_dictionary<std::string>::global();
+        stack<key, int> interned;
+        interned.push(key(std::string("present")), 1);
+        size_t const words = dictionary.size();
+        for (int i = 0; i < 100; ++i)
+            assert(interned.count("absent" + std::to_string(i)) == 0);
+        assert(interned.values(std::string("absent")).empty());
+        catched = false;
+        try {
+            interned.pop(std::string("absent"));
+        }
+        catch (std::invalid_argument&) {
+            catched = true;
+        }
+        assert(catched);
+        catched = false;
+        try {
+            (void)interned.front(std::string("absent"));
+        }
+        catch (std::invalid_argument&) {
+            catched = true;
+        }
+        auto absent = interned.key_handle(std::string("absent"));
+        assert(absent.count() == 0);
+        assert(catched && dictionary.size() == words);
+        assert(interned.count(std::string("present")) == 1);
+        assert(interned.front(std::string("present")) == 1);
+        interned.pop(std::string("present"));
+        assert(interned.size() == 0);
+    }
+    // compact() przenosi duze (pudelkowane) wartosci do nowej pamieci,
+    // zamiast wspoldzielic je ze stara kopia danych.
+    {
+        struct large {
+            int value;
+            char padding[96];
+        };
+        stack<int, large> boxed;
+        for (int i = 0; i < 10; ++i)
+            boxed.push(i % 3, large{i, {}});
+        stack<int, large> const old = boxed;
+        boxed.compact();
+        stack<int, large> const& compacted = boxed;
+        assert(compacted.size() == 10 && compacted.front().second.value == 9);
+        assert(&compacted.front().second != &old.front().second);
+        assert(&compacted.front(1) != &old.front(1));
+        assert(compacted.front(1).value == old.front(1).value);
+    }
+    // Opoznienia sa zbierane tylko dla stosu<int, short>.
+    {
+        using cxx::stack_operation;
+        cxx::stack_metrics::reset();
+        stack<int, short> measured;
+        stack<int, int> unmeasured;
+        for (int i = 0; i < 100; ++i) {
+            measured.push(i % 5, 1);
+            unmeasured.push(i % 5, 1);
+        }
+        measured.pop(3);
+        auto snapshot = cxx::stack_metrics::snapshot();
+        assert(snapshot[static_cast<size_t>(stack_operation::push)].count() == 100);
+        assert(snapshot[static_cast<size_t>(stack_operation::pop_key)].count() == 1);
+        assert(snapshot[static_cast<size_t>(stack_operation::pop)].count() == 0);
+    }
+    // Uchwyty elementow: usuniecie ze srodka stosu, kopia przy zapisie,
+    // pop, clear i append.
+    {
+        stack<int, int> handles;
+        handles.push(1, 10);
+        auto middle = handles.push_with_handle(2, 20);
+        handles.push(1, 11);
+        auto top = handles.push_with_handle(2, 21);
+        handles.erase(middle);
+        assert(!handles.contains(middle) && handles.contains(top));
+        assert(handles.size() == 3 && handles.count(2) == 1);
+        assert(handles.front(2) == 21 && handles.front(1) == 11);
+        catched = false;
+        try {
+            handles.erase(middle);
+        }
+        catch (invalid_argument&) {
+            catched = true;
+        }
+        assert(catched && handles.size() == 3);
+
+        // Kopia ma te same uchwyty; kazdy stos usuwa tylko swoj element.
+        stack<int, int> split = handles;
+        assert(split.contains(top) && handles.contains(top));
+        split.erase(top);
+        assert(!split.contains(top) && handles.contains(top));
+        assert(split.count(2) == 0 && handles.count(2) == 1);
+        handles.erase(top);
+        assert(!handles.contains(top) && handles.count(2) == 0);
+        assert(handles.size() == 2 && split.size() == 2);
+        assert(handles.front().second == 11 && split.front().second == 11);
+
+        auto popped = handles.push_with_handle(4, 40);
+        handles.pop();
+        assert(!handles.contains(popped) && handles.count(4) == 0);
+        auto popped_key = handles.push_with_handle(4, 41);
+        handles.push(5, 50);
+        handles.pop(4);
+        assert(!handles.contains(popped_key) && handles.front().first == 5);
+        auto cleared = handles.push_with_handle(4, 42);
+        handles.clear();
+        assert(!handles.contains(cleared) && handles.size() == 0);
+        handles.push(4, 43);
+        assert(!handles.contains(cleared));
+
+        // Po append sledzona zostaje tylko kopia, ktora juz byla w stosie.
+        stack<int, int> first;
+        auto shared = first.push_with_handle(6, 60);
+        stack<int, int> second = first;
+        second.front(6) = 61;
+        second.push(7, 70);
+        first.append(std::move(second));
+        assert(second.size() == 0 && !second.contains(shared));
+        assert(first.size() == 3 && first.count(6) == 2);
+        assert(first.contains(shared));
+        first.erase(shared);
+        assert(!first.contains(shared));
+        assert(first.count(6) == 1 && first.front(6) == 61);
+    }
+    // extract i insert przenosza wezly elementu bez alokacji: razem z
+    // wezlami klucza, gdy to jego ostatni element, albo z kopia klucza,
+    // gdy klucz ma jeszcze inne elementy.
+    {
+        stack<int, int> source;
+        stack<int, int> target;
+        source.push(1, 10);
+        source.push(2, 20);
+        source.push(1, 11);
+        target.push(3, 30);
+        target.push(1, 5);
+
+        cxx::allocation_probe last_of_key;
+        auto node = source.extract(2);
+        assert(node && node.key() == 2 && node.value() == 20);
+        target.insert(std::move(node));
+        assert(last_of_key.within_budget(0));
+        assert(node.empty());
+        assert(source.count(2) == 0 && target.count(2) == 1);
+        assert(target.front().first == 2 && target.front().second == 20);
+
+        cxx::allocation_probe other_elements;
+        node = source.extract(1);
+        assert(node.key() == 1 && node.value() == 11);
+        node.value() = 12;
+        target.insert(std::move(node));
+        assert(other_elements.within_budget(0));
+        assert(source.size() == 1 && source.count(1) == 1);
+        assert(source.front(1) == 10);
+        assert(target.size() == 4 && target.count(1) == 2);
+        assert(target.front(1) == 12 && target.front().first == 1);
+        target.pop(1);
+        assert(target.front(1) == 5 && target.count(3) == 1);
+
+        cxx::allocation_probe last_element;
+        node = source.extract();
+        target.insert(std::move(node));
+        assert(last_element.within_budget(0));
+        assert(source.size() == 0 && source.count(1) == 0);
+        assert(target.count(1) == 2 && target.front(1) == 10);
+        target.insert(std::move(node));
+        assert(target.size() == 4);
+    }
+    // splice_key: klucz nowy w stosie docelowym, klucz juz w nim obecny,
+    // przeniesienie w obrebie jednego stosu i zrodlo wspoldzielace dane.
+    {
+        stack<int, int> from;
+        stack<int, int> to;
+        from.push(1, 10);
+        from.push(2, 20);
+        from.push(1, 11);
+        from.push(3, 30);
+        to.push(2, 5);
+
+        to.splice_key(from, 1);
+        assert(from.size() == 2 && from.count(1) == 0);
+        assert(to.size() == 3 && to.count(1) == 2);
+        assert(to.front().first == 1 && to.front(1) == 11);
+        to.pop(1);
+        assert(to.front(1) == 10 && to.front().second == 10);
+
+        to.splice_key(from, 2);
+        assert(from.size() == 1 && from.count(2) == 0);
+        assert(to.count(2) == 2 && to.front(2) == 20);
+        assert(to.front().first == 2 && to.front().second == 20);
+        to.pop();
+        assert(to.front(2) == 5 && to.front().first == 1);
+
+        stack<int, int> own;
+        own.push(1, 1);
+        own.push(2, 2);
+        own.push(1, 3);
+        own.push(3, 4);
+        own.splice_key(own, 1);
+        assert(own.size() == 4 && own.count(1) == 2);
+        vector<pair<int, int>> order;
+        for (auto [key, value] : own.elements())
+            order.emplace_back(key, value);
+        assert((order == vector<pair<int, int>>{{2, 2}, {3, 4}, {1, 1}, {1, 3}}));
+
+        stack<int, int> shared = from;
+        stack<int, int> receiver;
+        receiver.push(3, 31);
+        receiver.splice_key(from, 3);
+        assert(from.size() == 0 && from.count(3) == 0);
+        assert(shared.size() == 1 && shared.front(3) == 30);
+        assert(receiver.count(3) == 2 && receiver.front(3) == 30);
+        receiver.pop(3);
+        assert(receiver.front(3) == 31);
+    }
+    // append z nakladajacymi sie kluczami i split_at na glebokosci 0,
+    // rownej rozmiarowi i posrednich; uchwyty przechodza z elementami.
+    {
+        auto contents = [](stack<int, int> const& s) {
+            vector<pair<int, int>> result;
+            for (auto [key, value] : s.elements())
+                result.emplace_back(key, value);
+            return result;
+        };
+        using elements = vector<pair<int, int>>;
+
+        stack<int, int> lower;
+        stack<int, int> upper;
+        lower.push(1, 10);
+        lower.push(2, 20);
+        upper.push(2, 21);
+        auto moved = upper.push_with_handle(3, 30);
+        upper.push(1, 11);
+        lower.append(std::move(upper));
+        assert(upper.size() == 0 && upper.count(1) == 0);
+        assert((contents(lower) ==
+                elements{{1, 10}, {2, 20}, {2, 21}, {3, 30}, {1, 11}}));
+        assert(lower.count(1) == 2 && lower.count(2) == 2);
+        assert(lower.front(1) == 11 && lower.front(2) == 21);
+        assert(lower.contains(moved) && !upper.contains(moved));
+        lower.pop(2);
+        assert(lower.front(2) == 20);
+
+        stack<int, int> nothing = lower.split_at(0);
+        assert(nothing.size() == 0 && lower.size() == 4);
+
+        auto top = lower.split_at(2);
+        assert((contents(top) == elements{{3, 30}, {1, 11}}));
+        assert((contents(lower) == elements{{1, 10}, {2, 20}}));
+        assert(top.contains(moved) && !lower.contains(moved));
+        assert(top.count(1) == 1 && lower.count(1) == 1);
+        assert(top.count(2) == 0 && lower.front(1) == 10);
+        top.erase(moved);
+        assert(top.size() == 1 && top.count(3) == 0);
+
+        auto tracked_all = lower.push_with_handle(4, 40);
+        stack<int, int> kept = lower;
+        auto all = lower.split_at(lower.size());
+        assert(lower.size() == 0 && lower.count(1) == 0);
+        assert((contents(all) == elements{{1, 10}, {2, 20}, {4, 40}}));
+        assert(all.contains(tracked_all) && !lower.contains(tracked_all));
+        assert(kept.size() == 3 && kept.contains(tracked_all));
+        all.erase(tracked_all);
+        assert(all.size() == 2 && kept.count(4) == 1);
+    }
+    // Sumy kluczy po zmianach wartosci przez front() i values(), a potem
+    // po pop, touch, erase(uchwyt) i split_at.
+    {
+        stack<int, long long> sums;
+        auto check = [](stack<int, long long> const& s) {
+            long long total = 0;
+            for (int key = 0; key < 4; ++key) {
+                long long expected = 0;
+                for (long long value : s.values(key))
+                    expected += value;
+                assert(s.aggregate(key) == expected);
+                total += expected;
+            }
+            assert(s.aggregate() == total);
+        };
+        sums.push(0, 1);
+        sums.push(1, 2);
+        auto handle = sums.push_with_handle(0, 3);
+        sums.push(2, 4);
+        sums.push(1, 5);
+        sums.push(0, 6);
+        check(sums);
+        assert(sums.aggregate(0) == 10 && sums.aggregate() == 21);
+
+        sums.front().second = 60;
+        check(sums);
+        sums.front(1) = 50;
+        check(sums);
+        for (long long& value : sums.values(0))
+            value *= 2;
+        check(sums);
+        assert(sums.aggregate(0) == 2 + 6 + 120);
+
+        sums.pop();
+        check(sums);
+        sums.pop(1);
+        check(sums);
+        sums.touch(0);
+        check(sums);
+        sums.touch(handle);
+        check(sums);
+        sums.push(3, 7);
+        sums.erase(handle);
+        check(sums);
+        assert(sums.aggregate(0) == 2 && sums.aggregate(3) == 7);
+
+        auto top = sums.split_at(2);
+        check(sums);
+        check(top);
+        assert(sums.aggregate() + top.aggregate() == 2 + 2 + 4 + 7);
+        top.front().second = 8;
+        check(top);
+        assert(top.aggregate(3) == 8 && sums.aggregate(3) == 0);
+    }
+    // counts() i count_many(): zapytania pojedyncze i wspolny przebieg po
+    // posortowanych kluczach, z powtorzonymi i nieobecnymi kluczami.
+    {
+        stack<int, int> many;
+        for (int key = 0; key < 1000; ++key)
+            for (int j = 0; j <= key % 4; ++j)
+                many.push(key * 2, j);
+        auto expected = [](int key) -> size_t {
+            return key >= 0 && key < 2000 && key % 2 == 0 ? key / 2 % 4 + 1 : 0;
+        };
+
+        auto all = many.counts();
+        assert(all.size() == 1000);
+        for (size_t i = 0; i < all.size(); ++i)
+            assert(all[i].first == static_cast<int>(i) * 2 &&
+                   all[i].second == expected(all[i].first));
+
+        // 10 zapytan * bit_width(1000) < 1000: kazdy klucz osobno.
+        vector<int> few{6, 7, 6, -1, 1998, 2000, 0, 6, 501, 502};
+        auto few_counts = many.count_many(few);
+        assert(few_counts.size() == few.size());
+        for (size_t i = 0; i < few.size(); ++i)
+            assert(few_counts[i] == expected(few[i]));
+
+        // 300 zapytan: sortowanie i jeden przebieg po drzewie kluczy.
+        vector<int> lots;
+        for (int i = 0; i < 300; ++i)
+            lots.push_back((i * 37) % 2100 - 50);
+        lots.push_back(lots[5]);
+        lots.push_back(2500);
+        lots.push_back(-7);
+        auto lots_counts = many.count_many(lots);
+        for (size_t i = 0; i < lots.size(); ++i)
+            assert(lots_counts[i] == expected(lots[i]));
+
+        stack<int, int> none;
+        assert((none.count_many(lots) == vector<size_t>(lots.size(), 0)));
+        assert(none.counts().empty());
+    }
+    // for_each i transform_reduce: execution::par daje to samo co seq
+    // na stosie wiekszym niz 2 * parallel_grain, takze dla jednego
+    // ogromnego klucza; wyjatek z watku roboczego jest przekazywany dalej.
+    {
+        using cxx::execution::par;
+        using cxx::execution::seq;
+        size_t const n = 2 * cxx::parallel_grain + 1000;
+        stack<int, int> wide;
+        stack<int, int> single;
+        for (size_t i = 0; i < n; ++i) {
+            wide.push(static_cast<int>(i % 997), static_cast<int>(i));
+            single.push(7, static_cast<int>(i % 100));
+        }
+        auto weigh = [](int key, int value) {
+            return static_cast<long long>(key) * 1000003 + value;
+        };
+        for (stack<int, int> const* s : {&wide, &single}) {
+            std::atomic<long long> par_sum{0};
+            std::atomic<size_t> par_calls{0};
+            s->for_each(par, [&](int key, int value) {
+                par_sum += weigh(key, value);
+                ++par_calls;
+            });
+            long long seq_sum = 0;
+            size_t seq_calls = 0;
+            s->for_each(seq, [&](int key, int value) {
+                seq_sum += weigh(key, value);
+                ++seq_calls;
+            });
+            assert(par_calls == n && seq_calls == n && par_sum == seq_sum);
+
+            auto plus = [](long long a, long long b) { return a + b; };
+            long long par_total = s->transform_reduce(par, 5LL, plus, weigh);
+            long long seq_total = s->transform_reduce(seq, 5LL, plus, weigh);
+            assert(par_total == seq_total && seq_total == seq_sum + 5);
+            auto larger = [](long long a, long long b) { return std::max(a, b); };
+            assert(s->transform_reduce(par, -1LL, larger, weigh) ==
+                   s->transform_reduce(seq, -1LL, larger, weigh));
+        }
+
+        // Najwiekszy klucz trafia do ostatniego zakresu, czyli do watku
+        // roboczego, gdy watkow jest wiecej niz jeden.
+        for (auto policy_is_par : {true, false}) {
+            catched = false;
+            try {
+                auto fail = [](int key, int) {
+                    if (key == 996)
+                        throw std::runtime_error("worker failed");
+                };
+                if (policy_is_par)
+                    wide.for_each(par, fail);
+                else
+                    wide.for_each(seq, fail);
+            }
+            catch (std::runtime_error&) {
+                catched = true;
+            }
+            assert(catched);
+        }
+        catched = false;
+        try {
+            wide.transform_reduce(par, 0, [](int a, int b) { return a + b; },
+                [](int key, int value) {
+                    if (key == 996)
+                        throw std::runtime_error("worker failed");
+                    return value;
+                });
+        }
+        catch (std::runtime_error&) {
+            catched = true;
+        }
+        assert(catched && wide.size() == n);
+    }
+    // Przeniesiony stos jest pusty i mozna go dalej uzywac, takze po
+    // przeniesieniu na samego siebie.
+    {
+        stack<int, int> source;
+        for (int i = 0; i < 10; ++i)
+            source.push(i % 3, i);
+        stack<int, int> target(std::move(source));
+        assert(source.size() == 0 && target.size() == 10);
+        source.push(5, 50);
+        assert(source.size() == 1 && source.front(5) == 50);
+        stack<int, int> assigned;
+        assigned.push(1, 1);
+        assigned = std::move(target);
+        assert(target.size() == 0 && assigned.size() == 10);
+        assert(assigned.front().second == 9);
+        target.push(7, 70);
+        assert(target.size() == 1 && target.count(7) == 1);
+        stack<int, int>& alias = assigned;
+        assigned = std::move(alias);
+        assert(assigned.size() == 10 && assigned.count(0) == 4);
+        // swap() przenosi razem z danymi informacje, ze sa na nie
+        // referencje, wiec kopia takiego stosu dostaje wlasne dane.
+        int& held = assigned.front(0);
+        assigned.swap(source);
+        assert(source.size() == 10 && assigned.size() == 1);
+        stack<int, int> const copy = source;
+        held = -1;
+        assert(source.front(0) == -1 && copy.front(0) == 9);
+    }
+    // Dane z co najmniej min_elements elementami zwalnia watek w tle:
+    // przy zniszczeniu stosu, przy clear() i przy przypisaniu.
+    {
+        auto& reclaimer = cxx::stack_reclaimer::global();
+        auto fill = [](stack<int, reclaimed>& s, int n) {
+            for (int i = 0; i < n; ++i)
+                s.push(i % 7, reclaimed{ i });
+        };
+        {
+            stack<int, reclaimed> small;
+            fill(small, 10);
+        }
+        reclaimer.drain();
+        assert(reclaimed_values == 0);
+        {
+            stack<int, reclaimed> large;
+            fill(large, 200);
+        }
+        reclaimer.drain();
+        assert(reclaimed_values == 200);
+        stack<int, reclaimed> cleared;
+        fill(cleared, 150);
+        cleared.clear();
+        reclaimer.drain();
+        assert(reclaimed_values == 350 && cleared.size() == 0);
+        fill(cleared, 10);
+        stack<int, reclaimed> assigned;
+        fill(assigned, 120);
+        assigned = cleared;
+        reclaimer.drain();
+        assert(reclaimed_values == 470 && assigned.size() == 10);
+        // Dane wciaz wspoldzielone przez inny stos nie trafiaja do watku.
+        stack<int, reclaimed> shared;
+        fill(shared, 100);
+        stack<int, reclaimed> const holder = shared;
+        shared.clear();
+        reclaimer.drain();
+        assert(reclaimed_values == 470 && holder.size() == 100);
+    }
+    // Uchwyt klucza zauwaza, ze jego iteratory moga byc nieaktualne:
+    // po rozdzieleniu danych, usunieciu klucza, clear() i swap().
+    {
+        stack<int, int> keyed;
+        auto handle = keyed.key_handle(4);
+        assert(handle.count() == 0);
+        handle.push(40); // Klucza nie bylo w stosie.
+        handle.push(41);
+        keyed.push(5, 50);
+        assert(handle.count() == 2 && keyed.count(4) == 2);
+        stack<int, int> const shared = keyed;
+        handle.push(42); // Rozdziela dane.
+        assert(handle.count() == 3 && shared.count(4) == 2);
+        assert(handle.front() == 42 && shared.front(4) == 41);
+        keyed.pop(4);
+        keyed.pop(4);
+        keyed.pop(4);
+        assert(handle.count() == 0);
+        catched = false;
+        try {
+            handle.pop();
+        }
+        catch (invalid_argument&) {
+            catched = true;
+        }
+        assert(catched);
+        handle.push(43);
+        assert(handle.count() == 1 && keyed.front(4) == 43);
+        keyed.clear();
+        assert(handle.count() == 0 && keyed.size() == 0);
+        handle.push(44);
+        stack<int, int> other;
+        other.push(4, 1);
+        other.push(4, 2);
+        other.push(6, 3);
+        keyed.swap(other);
+        assert(handle.count() == 2 && handle.front() == 2);
+        handle.pop();
+        assert(keyed.count(4) == 1 && other.count(4) == 1);
+        assert(other.front(4) == 44);
+    }
+    // Elementy z najwiekszym i najmniejszym kluczem, takze gdy zdjecie
+    // ostatniego elementu klucza zmienia skrajny klucz.
+    {
+        stack<int, int> extremes;
+        extremes.push(5, 50);
+        extremes.push(1, 10);
+        extremes.push(9, 90);
+        extremes.push(5, 51);
+        extremes.push(1, 11);
+        extremes.push(9, 91);
+        extremes.push(3, 30);
+        assert(extremes.front_max_key().first == 9);
+        assert(extremes.front_max_key().second == 91);
+        assert(extremes.front_min_key().first == 1);
+        assert(extremes.front_min_key().second == 11);
+        extremes.front_min_key().second = 12;
+        stack<int, int> const& view = extremes;
+        assert(view.front_min_key().second == 12);
+        assert(view.front().first == 3); // Wierzch sie nie zmienia.
+        extremes.pop_max_key();
+        assert(extremes.front_max_key().second == 90);
+        assert(extremes.size() == 6 && extremes.front().first == 3);
+        extremes.pop_max_key(); // Ostatni element klucza 9.
+        assert(extremes.count(9) == 0);
+        assert(extremes.front_max_key().first == 5);
+        assert(extremes.front_max_key().second == 51);
+        extremes.pop_min_key();
+        extremes.pop_min_key(); // Ostatni element klucza 1.
+        assert(extremes.count(1) == 0);
+        assert(view.front_min_key().first == 3);
+        assert(view.front_min_key().second == 30);
+        extremes.pop_min_key();
+        assert(extremes.size() == 2);
+        assert(extremes.front_min_key().first == 5);
+        assert(extremes.front_max_key().first == 5);
+        extremes.pop_max_key();
+        extremes.pop_min_key();
+        assert(extremes.size() == 0);
+        catched = false;
+        try {
+            extremes.pop_max_key();
+        }
+        catch (invalid_argument&) {
+            catched = true;
+        }
+        assert(catched);
+        catched = false;
+        try {
+            (void)view.front_min_key();
+        }
+        catch (invalid_argument&) {
+            catched = true;
+        }
+        assert(catched);
+    }
+    // Po split_at, append i splice_key sumy przeniesionych elementow sa
+    // od razu przeliczone, wiec aggregate(klucz) nie laczy juz wartosci.
+    // Po values() sa przeliczane przy zdjeciu elementu z klucza.
+    {
+        using policy = cxx::stack_aggregate_policy<int, long long>;
+        auto settled = [](stack<int, long long> const& s, int key,
+                          long long expected) {
+            policy::combined = 0;
+            return s.aggregate(key) == expected && policy::combined == 0;
+        };
+        stack<int, long long> base;
+        for (int i = 1; i <= 12; ++i)
+            base.push(i % 3, i);
+        stack<int, long long> top = base.split_at(5);
+        assert(settled(top, 0, 9 + 12) && settled(top, 1, 10));
+        assert(settled(top, 2, 8 + 11) && settled(base, 1, 1 + 4 + 7));
+        base.append(std::move(top));
+        assert(settled(base, 0, 3 + 6 + 9 + 12));
+        assert(settled(base, 2, 2 + 5 + 8 + 11));
+        stack<int, long long> donor;
+        donor.push(1, 100);
+        donor.push(4, 400);
+        donor.push(1, 101);
+        base.splice_key(donor, 1);
+        assert(settled(base, 1, 1 + 4 + 7 + 10 + 100 + 101));
+        assert(donor.size() == 1 && settled(donor, 4, 400));
+        for (long long& value : base.values(0))
+            value += 1;
+        base.pop(0);
+        assert(settled(base, 0, 4 + 7 + 10));
+    }
 }
\ No newline at end of file